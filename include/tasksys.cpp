@@ -136,6 +136,9 @@ using namespace Concurrency;
 #include <stdlib.h>
 #include <string.h>
 
+// Execution tracing of the pthreads task system, see src/trace.h
+#include "trace.h"
+
 // Signature of ispc-generated 'task' functions
 typedef void (*TaskFuncType)(void *data, int threadIndex, int threadCount, int taskIndex, int taskCount, int taskIndex0,
                              int taskIndex1, int taskIndex2, int taskCount0, int taskCount1, int taskCount2);
@@ -552,12 +555,17 @@ static void *lTaskEntry(void *arg) {
     int threadIndex = (int)((int64_t)arg);
     int threadCount = nThreads;
 
+    char threadName[32];
+    snprintf(threadName, sizeof(threadName), "worker %d", threadIndex);
+    trace_thread_name(threadName);
+
     while (1) {
         int err;
         //
         // Wait on the semaphore until we're woken up due to the arrival of
         // more work.
         //
+        trace_idle();
         if ((err = sem_wait(workerSemaphore)) != 0) {
             fprintf(stderr, "Error from sem_wait: %s\n", strerror(err));
             exit(1);
@@ -608,9 +616,11 @@ static void *lTaskEntry(void *arg) {
         //
         DBG(fprintf(stderr, "running task %d from group %p\n", taskNumber, tg));
         TaskInfo *myTask = tg->GetTaskInfo(taskNumber);
+        uint64_t traced = trace_task_begin();
         myTask->func(myTask->data, threadIndex, threadCount, myTask->taskIndex, myTask->taskCount(),
                      myTask->taskIndex0(), myTask->taskIndex1(), myTask->taskIndex2(), myTask->taskCount0(),
                      myTask->taskCount1(), myTask->taskCount2());
+        trace_task_end(traced, (const void *)myTask->func, myTask->taskIndex, myTask->taskCount());
 
         //
         // Decrement the "number of unfinished tasks" counter in the task
@@ -739,6 +749,7 @@ inline void TaskGroup::Launch(int baseCoord, int count) {
 
 inline void TaskGroup::Sync() {
     DBG(fprintf(stderr, "syncing %p - %d unfinished\n", tg, numUnfinishedTasks));
+    uint64_t traced = trace_sync_begin();
 
     while (numUnfinishedTasks > 0) {
         // All of the tasks in this group aren't finished yet.  We'll try
@@ -785,6 +796,7 @@ inline void TaskGroup::Sync() {
                 // be much better to put this thread to sleep on a
                 // condition variable that was signaled when the last task
                 // in this group was finished.
+                trace_idle();
                 usleep(1);
                 continue;
             }
@@ -814,9 +826,11 @@ inline void TaskGroup::Sync() {
         // Do work for _myTask_
         //
         // FIXME: bogus values for thread index/thread count here as well..
+        uint64_t tracedTask = trace_task_begin();
         myTask->func(myTask->data, 0, 1, myTask->taskIndex, myTask->taskCount(), myTask->taskIndex0(),
                      myTask->taskIndex1(), myTask->taskIndex2(), myTask->taskCount0(), myTask->taskCount1(),
                      myTask->taskCount2());
+        trace_task_end(tracedTask, (const void *)myTask->func, myTask->taskIndex, myTask->taskCount());
 
         //
         // Decrement the number of unfinished tasks counter
@@ -824,6 +838,7 @@ inline void TaskGroup::Sync() {
         lMemFence();
         lAtomicAdd(&runtg->numUnfinishedTasks, -1);
     }
+    trace_sync_end(traced);
     DBG(fprintf(stderr, "sync for %p done!n", tg));
 }
 
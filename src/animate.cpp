@@ -0,0 +1,344 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fractal.h"
+#include "color.h"
+#include "export.h"
+#include "video.h"
+#include "schedule.h"
+
+using namespace std;
+using namespace chrono;
+using namespace ispc;
+
+// The camera at one point in time, frames in between are interpolated
+struct Keyframe {
+  double time;
+  DoubleDouble x_pos;
+  DoubleDouble y_pos;
+  double zoom;
+  int n;
+  int max_iter;
+};
+
+struct View {
+  DoubleDouble x_pos;
+  DoubleDouble y_pos;
+  double zoom;
+  int n;
+  int max_iter;
+};
+
+void usage(const char* program) {
+  fprintf(stderr,
+    "Usage: %s --keyframes <path> [options]\n"
+    "  --keyframes <path>    one keyframe per line: <seconds> <x> <y> <zoom> <n> <max-iter>, # starts a comment\n"
+    "  --fps <int>           frames per second of the animation (default 30)\n"
+    "  --size <W>x<H>        output resolution (default 1024x1024)\n"
+    "  --mode <serial|simd|threaded|fused|subdivide>  kernel to run (default threaded)\n"
+    "  --tasks <int>         task count of every frame for the threaded modes (default one per hardware thread)\n"
+    "  --frames-in-flight <int>  frames rendered at the same time (default 4)\n"
+    "  --tile-size <int>     side of the square tiles the tasks claim (default 32)\n"
+    "  --depth-tol <int>     subdivide mode fills rectangles whose border depths are this close (default 0)\n"
+    "  --precision <auto|float|double|double-double>  iteration precision, auto picks it per frame (default auto)\n"
+    "  --tol <double>        convergence tolerance (default 2.4e-7)\n"
+    "  --output <path>       .gif, .y4m or any ffmpeg video, or a printf pattern like frame_%%05d.ppm for an image sequence (default animation.y4m)\n"
+    "  --k <double>          color banding strength (default 5)\n"
+    "  --min-brightness <double>  (default 0.4)\n",
+    program);
+}
+
+bool read_keyframes(const char* path, vector<Keyframe>& keyframes) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Failed to open %s\n", path);
+    return false;
+  }
+
+  char line[1024];
+  int line_number = 0;
+  bool ok = true;
+  while (ok && fgets(line, sizeof(line), file)) {
+    line_number++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+    // The center is parsed from the text so digits beyond double precision survive
+    Keyframe keyframe;
+    char x_text[256];
+    char y_text[256];
+    int fields = sscanf(line, "%lf %255s %255s %lf %d %d", &keyframe.time, x_text, y_text, &keyframe.zoom, &keyframe.n, &keyframe.max_iter);
+    if (fields <= 0) {
+      continue;
+    }
+    if (fields != 6) {
+      fprintf(stderr, "%s:%d: expected <seconds> <x> <y> <zoom> <n> <max-iter>\n", path, line_number);
+      ok = false;
+    } else if (!keyframes.empty() && keyframe.time <= keyframes.back().time) {
+      fprintf(stderr, "%s:%d: keyframe times have to increase\n", path, line_number);
+      ok = false;
+    } else if (keyframe.zoom <= 0.0 || keyframe.n < 1 || keyframe.n > ROOT_COLOR_COUNT || keyframe.max_iter <= 0 || keyframe.max_iter > MAX_ITER_LIMIT) {
+      fprintf(stderr, "%s:%d: zoom has to be positive, n between 1 and %d and max-iter between 1 and %d\n", path, line_number, ROOT_COLOR_COUNT, MAX_ITER_LIMIT);
+      ok = false;
+    } else {
+      keyframe.x_pos = dd_parse(x_text);
+      keyframe.y_pos = dd_parse(y_text);
+      keyframes.push_back(keyframe);
+    }
+  }
+  fclose(file);
+
+  if (ok && keyframes.empty()) {
+    fprintf(stderr, "%s has no keyframes\n", path);
+    ok = false;
+  }
+  return ok;
+}
+
+// The zoom is interpolated exponentially so every frame magnifies by the same factor. The center
+// moves in proportion to the change of the visible width rather than linearly in time, at a
+// constant rate on screen it would otherwise shoot past its target while zooming in
+View interpolate(const vector<Keyframe>& keyframes, double time) {
+  int i = 0;
+  while (i + 2 < (int)keyframes.size() && keyframes[i + 1].time <= time) {
+    i++;
+  }
+  const Keyframe& from = keyframes[i];
+  if (keyframes.size() == 1) {
+    return {from.x_pos, from.y_pos, from.zoom, from.n, from.max_iter};
+  }
+  const Keyframe& to = keyframes[i + 1];
+  double s = clamp((time - from.time) / (to.time - from.time), 0.0, 1.0);
+
+  View view;
+  view.zoom = from.zoom * pow(to.zoom / from.zoom, s);
+  double weight = s;
+  if (fabs(log(to.zoom / from.zoom)) > 1e-9) {
+    weight = (1.0 / view.zoom - 1.0 / from.zoom) / (1.0 / to.zoom - 1.0 / from.zoom);
+  }
+  view.x_pos = from.x_pos + (to.x_pos - from.x_pos) * weight;
+  view.y_pos = from.y_pos + (to.y_pos - from.y_pos) * weight;
+  // The degree switches at the next keyframe, changing it halfway has no in-between
+  view.n = s < 1.0 ? from.n : to.n;
+  view.max_iter = (int)lround(from.max_iter + (to.max_iter - from.max_iter) * s);
+  return view;
+}
+
+bool export_ppm(const ExportFrame& frame, void* context) {
+  return write_ppm(frame.path, frame.pixels.data(), frame.width, frame.height);
+}
+
+bool export_video(const ExportFrame& frame, void* context) {
+  return video_write(*(VideoWriter*)context, frame.pixels.data());
+}
+
+// Frames are claimed in order by the renderers but finish out of order, each one waits for its
+// predecessor to be queued before queuing itself
+struct FrameOrder {
+  mutex lock;
+  condition_variable advanced;
+  int next = 0;
+};
+
+int main(int argc, char** argv) {
+  const char* keyframe_path = nullptr;
+  int fps = 30;
+  int width = 1024;
+  int height = 1024;
+  Mode mode = SIMD_THREADED;
+  int task_count = default_task_count();
+  int frames_in_flight = 4;
+  int tile_size = DEFAULT_TILE_SIZE;
+  int depth_tol = 0;
+  Precision fixed_precision = PRECISION_DOUBLE;
+  bool auto_precision = true;
+  double tolerance = DEFAULT_TOLERANCE;
+  string output = "animation.y4m";
+  double k = 5.0;
+  double min_brightness = 0.4;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if (strcmp(arg, "--keyframes") == 0) {
+      keyframe_path = value;
+    } else if (strcmp(arg, "--fps") == 0) {
+      fps = atoi(value);
+    } else if (strcmp(arg, "--size") == 0) {
+      if (sscanf(value, "%dx%d", &width, &height) != 2) {
+        fprintf(stderr, "Invalid size %s, expected <W>x<H>\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--mode") == 0) {
+      if (!parse_mode(value, &mode)) {
+        fprintf(stderr, "Unknown mode %s\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--tasks") == 0) {
+      task_count = atoi(value);
+    } else if (strcmp(arg, "--frames-in-flight") == 0) {
+      frames_in_flight = atoi(value);
+    } else if (strcmp(arg, "--tile-size") == 0) {
+      tile_size = atoi(value);
+    } else if (strcmp(arg, "--depth-tol") == 0) {
+      depth_tol = atoi(value);
+    } else if (strcmp(arg, "--precision") == 0) {
+      if (!parse_precision(value, &fixed_precision, &auto_precision)) {
+        fprintf(stderr, "Unknown precision %s\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--tol") == 0) {
+      tolerance = strtod(value, nullptr);
+    } else if (strcmp(arg, "--output") == 0) {
+      output = value;
+    } else if (strcmp(arg, "--k") == 0) {
+      k = strtod(value, nullptr);
+    } else if (strcmp(arg, "--min-brightness") == 0) {
+      min_brightness = strtod(value, nullptr);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (!keyframe_path) {
+    fprintf(stderr, "--keyframes is required\n");
+    usage(argv[0]);
+    return 1;
+  }
+  if (width <= 0 || height <= 0 || fps <= 0 || task_count <= 0 || frames_in_flight <= 0 || tile_size <= 0) {
+    fprintf(stderr, "size, fps, tasks, frames-in-flight and tile-size must be positive\n");
+    return 1;
+  }
+  if ((int64_t)width * height > MAX_GRID_PIXELS) {
+    fprintf(stderr, "%dx%d has more than %lld pixels\n", width, height, (long long)MAX_GRID_PIXELS);
+    return 1;
+  }
+  if (depth_tol < 0) {
+    fprintf(stderr, "depth-tol can't be negative\n");
+    return 1;
+  }
+
+  vector<Keyframe> keyframes;
+  if (!read_keyframes(keyframe_path, keyframes)) {
+    return 1;
+  }
+  double duration = keyframes.back().time - keyframes.front().time;
+  int frame_count = (int)floor(duration * fps + 1e-9) + 1;
+
+  // An output containing a % is a printf pattern for numbered images, anything else one video
+  bool sequence = output.find('%') != string::npos;
+  VideoWriter writer;
+  Exporter exporter;
+  if (sequence) {
+    exporter_start(exporter, export_ppm, nullptr, max(1, task_count / 4), frames_in_flight, EXPORT_BLOCK);
+  } else {
+    if (!video_open(writer, output, width, height, fps)) {
+      fprintf(stderr, "Failed to open %s\n", output.c_str());
+      return 1;
+    }
+    exporter_start(exporter, export_video, &writer, 1, frames_in_flight, EXPORT_BLOCK);
+  }
+
+  // Every renderer launches its frame over all task_count tasks. The tasks of all frames in flight
+  // share the same worker threads, so when a frame runs out of tiles the threads move on to the
+  // tiles of the others instead of idling until the slowest tile of the frame is done
+  atomic<int> next_frame = 0;
+  FrameOrder order;
+  atomic<long> compute_nanos = 0;
+  auto before = steady_clock::now();
+
+  auto render_frames = [&]() {
+    Grid grid = grid_alloc((size_t)width * height);
+    vector<Rgba> pixels((size_t)width * height);
+    Palette palette;
+    // The grid still holds this renderer's last frame, a few frames back. It predicts which tiles
+    // of the next one are expensive, so they are claimed first
+    TileSchedule schedule;
+    View previous;
+    bool has_previous = false;
+
+    for (int frame = next_frame++; frame < frame_count; frame = next_frame++) {
+      View view = interpolate(keyframes, keyframes.front().time + (double)frame / fps);
+      Precision precision = fixed_precision;
+      if (auto_precision) {
+        precision = select_precision(height, width, view.x_pos.hi, view.y_pos.hi, view.zoom, tolerance);
+      }
+      if (mode == SERIAL) {
+        precision = PRECISION_DOUBLE;
+      }
+      palette_update(palette, view.n, view.max_iter, k, min_brightness, 0);
+
+      auto compute_before = steady_clock::now();
+      if (mode == SIMD_FUSED) {
+        fractal_rgba(pixels.data(), height, width, view.x_pos, view.y_pos, tolerance, view.zoom, precision, palette, task_count, tile_size, Generation());
+      } else {
+        const int32_t* tile_order = nullptr;
+        if (mode == SIMD_THREADED && has_previous) {
+          schedule_from_grid(schedule, grid.depth, height, width, previous.x_pos, previous.y_pos, previous.zoom, height, width, view.x_pos, view.y_pos, view.zoom, tile_size);
+          tile_order = schedule_order(schedule, height, width, tile_size);
+        }
+        fractal(mode, precision, grid, height, width, view.x_pos, view.y_pos, view.n, view.max_iter, tolerance, view.zoom, task_count, tile_size, tile_order, depth_tol, Generation());
+        colorize(pixels.data(), grid, width * height, palette, task_count);
+        previous = view;
+        has_previous = true;
+      }
+      compute_nanos += duration_cast<nanoseconds>(steady_clock::now() - compute_before).count();
+
+      unique_lock<mutex> lock(order.lock);
+      order.advanced.wait(lock, [&] { return order.next == frame; });
+      // Blocks while the queue is full, which also keeps the renderers from running ahead of the writer
+      exporter_push(exporter, pixels.data(), width, height, output);
+      order.next++;
+      order.advanced.notify_all();
+    }
+    grid_free(grid);
+  };
+
+  vector<thread> renderers;
+  for (int i = 0; i < min(frames_in_flight, frame_count); i++) {
+    renderers.emplace_back(render_frames);
+  }
+  for (thread& renderer : renderers) {
+    renderer.join();
+  }
+  exporter_stop(exporter);
+  bool written = exporter.failed == 0;
+  if (!sequence) {
+    written = video_close(writer) && written;
+  }
+  auto wall_duration = duration_cast<chrono::duration<double>>(steady_clock::now() - before);
+
+  if (!written) {
+    fprintf(stderr, "Failed to write %s\n", output.c_str());
+    return 1;
+  }
+
+  printf(
+    "{\"mode\":\"%s\",\"isa\":\"%s\",\"width\":%d,\"height\":%d,\"tasks\":%d,\"frames_in_flight\":%d,\"tile_size\":%d,\"fps\":%d,"
+    "\"frames\":%d,\"wall_secs\":%.6f,\"compute_secs\":%.6f,\"frames_per_sec\":%.3f,\"output\":\"%s\"}\n",
+    MODE_NAME[mode], target_name().c_str(), width, height, task_count, frames_in_flight, tile_size, fps,
+    frame_count, wall_duration.count(), compute_nanos / 1e9, frame_count / wall_duration.count(), json_escape(output).c_str());
+  return 0;
+}
@@ -0,0 +1,419 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fractal.h"
+#include "color.h"
+#include "schedule.h"
+
+using namespace std;
+using namespace chrono;
+using namespace ispc;
+
+struct Hotspot {
+  const char* name;
+  double x_pos;
+  double y_pos;
+};
+
+// Spots with very different iteration depth profiles
+const Hotspot HOTSPOTS[] = {
+  {"origin", 0.0, 0.0},        // every basin meets here, deep iterations near the center
+  {"root", 1.0, 0.0},          // inside the basin of z = 1, converges fast
+  {"boundary", -0.5, 0.0},     // basin boundary for odd n
+};
+const int HOTSPOT_COUNT = sizeof(HOTSPOTS) / sizeof(HOTSPOTS[0]);
+
+// Order the threaded kernel claims its tiles in. previous predicts the costs from the frame of the
+// run before, which shows the same view, probe from a 1/64 preview. Both are timed with the frame
+enum Schedule {
+  SCHEDULE_ROWS,
+  SCHEDULE_PREVIOUS,
+  SCHEDULE_PROBE
+};
+
+const char* const SCHEDULE_NAME[] = {
+  "rows",
+  "previous",
+  "probe"
+};
+
+struct Run {
+  Mode mode;
+  bool auto_precision;
+  Precision precision;
+  int task_count;
+  int tile_size;
+  Schedule schedule;
+  int depth_tol;
+  int view;
+  int n;
+  int max_iter;
+  double zoom;
+};
+
+void usage(const char* program) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  --modes <list>        comma separated serial,simd,threaded,fused,subdivide (default all)\n"
+    "  --tasks <list>        task counts for the threaded modes (default one per hardware thread)\n"
+    "  --tile-sizes <list>   tile sides for the threaded modes (default 32)\n"
+    "  --schedules <list>    rows,previous,probe tile orders for the threaded mode (default rows)\n"
+    "  --depth-tols <list>   depth tolerances for subdivide mode (default 0)\n"
+    "  --precision <list>    auto,float,double,double-double for the ISPC kernels (default auto)\n"
+    "  --n <list>            polynomial degrees (default 1..10)\n"
+    "  --max-iter <list>     iteration limits (default 50,200,1000)\n"
+    "  --zoom <list>         magnification, 1 shows a plane 4 units wide (default 1,100,10000)\n"
+    "  --views <list>        origin,root,boundary (default all)\n"
+    "  --size <W>x<H>        frame resolution (default 512x512)\n"
+    "  --repeats <int>       timed runs per configuration (default 5)\n"
+    "  --tol <double>        convergence tolerance (default 2.4e-7)\n"
+    "  --output <path>       write the JSON report here instead of stdout\n",
+    program);
+}
+
+vector<string> split(const char* list) {
+  vector<string> items;
+  string item;
+  for (const char* c = list; ; c++) {
+    if (*c == ',' || *c == '\0') {
+      if (!item.empty()) {
+        items.push_back(item);
+      }
+      item.clear();
+      if (*c == '\0') {
+        break;
+      }
+    } else {
+      item += *c;
+    }
+  }
+  return items;
+}
+
+vector<int> parse_ints(const char* list) {
+  vector<int> values;
+  for (const string& item : split(list)) {
+    values.push_back(atoi(item.c_str()));
+  }
+  return values;
+}
+
+vector<double> parse_doubles(const char* list) {
+  vector<double> values;
+  for (const string& item : split(list)) {
+    values.push_back(strtod(item.c_str(), nullptr));
+  }
+  return values;
+}
+
+// Nearest rank percentile of sorted samples
+double percentile(const vector<double>& sorted, double p) {
+  int rank = (int)(p * sorted.size() + 0.999999) - 1;
+  return sorted[clamp(rank, 0, (int)sorted.size() - 1)];
+}
+
+struct GridErrors {
+  long long roots;
+  long long depths;
+  int max_depth;
+};
+
+// Pixels of grid that differ from the brute force reference
+GridErrors compare_grids(Grid grid, Grid reference, int pixel_count) {
+  GridErrors errors = {0, 0, 0};
+  for (int i = 0; i < pixel_count; i++) {
+    int depth_error = abs(grid.depth[i] - reference.depth[i]);
+    errors.roots += grid.root[i] != reference.root[i];
+    errors.depths += depth_error != 0;
+    errors.max_depth = max(errors.max_depth, depth_error);
+  }
+  return errors;
+}
+
+// Newton steps that were actually evaluated, a pixel that hit max_iter ran max_iter steps.
+// For subdivide mode this counts the filled pixels too, the rate is the brute force equivalent
+long long count_iterations(Grid grid, int pixel_count, int max_iter) {
+  long long total = 0;
+  for (int i = 0; i < pixel_count; i++) {
+    total += min(grid.depth[i] + 1, max_iter);
+  }
+  return total;
+}
+
+int main(int argc, char** argv) {
+  vector<Mode> modes = {SERIAL, SIMD, SIMD_THREADED, SIMD_FUSED, SIMD_SUBDIVIDE};
+  vector<int> task_counts = {default_task_count()};
+  vector<int> tile_sizes = {DEFAULT_TILE_SIZE};
+  vector<Schedule> schedules = {SCHEDULE_ROWS};
+  vector<int> depth_tols = {0};
+  // -1 stands for automatic selection
+  vector<int> precisions = {-1};
+  vector<int> degrees = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  vector<int> max_iters = {50, 200, 1000};
+  vector<double> zooms = {1.0, 100.0, 10000.0};
+  vector<int> views = {0, 1, 2};
+  int width = 512;
+  int height = 512;
+  int repeats = 5;
+  double tolerance = DEFAULT_TOLERANCE;
+  const char* output = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if (strcmp(arg, "--modes") == 0) {
+      modes.clear();
+      for (const string& name : split(value)) {
+        Mode mode;
+        if (!parse_mode(name.c_str(), &mode)) {
+          fprintf(stderr, "Unknown mode %s\n", name.c_str());
+          return 1;
+        }
+        modes.push_back(mode);
+      }
+    } else if (strcmp(arg, "--tasks") == 0) {
+      task_counts = parse_ints(value);
+    } else if (strcmp(arg, "--tile-sizes") == 0) {
+      tile_sizes = parse_ints(value);
+    } else if (strcmp(arg, "--schedules") == 0) {
+      schedules.clear();
+      for (const string& name : split(value)) {
+        int schedule = 0;
+        while (schedule <= SCHEDULE_PROBE && name != SCHEDULE_NAME[schedule]) {
+          schedule++;
+        }
+        if (schedule > SCHEDULE_PROBE) {
+          fprintf(stderr, "Unknown schedule %s\n", name.c_str());
+          return 1;
+        }
+        schedules.push_back((Schedule)schedule);
+      }
+    } else if (strcmp(arg, "--depth-tols") == 0) {
+      depth_tols = parse_ints(value);
+    } else if (strcmp(arg, "--precision") == 0) {
+      precisions.clear();
+      for (const string& name : split(value)) {
+        Precision precision;
+        bool automatic;
+        if (!parse_precision(name.c_str(), &precision, &automatic)) {
+          fprintf(stderr, "Unknown precision %s\n", name.c_str());
+          return 1;
+        }
+        precisions.push_back(automatic ? -1 : (int)precision);
+      }
+    } else if (strcmp(arg, "--n") == 0) {
+      degrees = parse_ints(value);
+    } else if (strcmp(arg, "--max-iter") == 0) {
+      max_iters = parse_ints(value);
+    } else if (strcmp(arg, "--zoom") == 0) {
+      zooms = parse_doubles(value);
+    } else if (strcmp(arg, "--views") == 0) {
+      views.clear();
+      for (const string& name : split(value)) {
+        int view = 0;
+        while (view < HOTSPOT_COUNT && name != HOTSPOTS[view].name) {
+          view++;
+        }
+        if (view == HOTSPOT_COUNT) {
+          fprintf(stderr, "Unknown view %s\n", name.c_str());
+          return 1;
+        }
+        views.push_back(view);
+      }
+    } else if (strcmp(arg, "--size") == 0) {
+      if (sscanf(value, "%dx%d", &width, &height) != 2) {
+        fprintf(stderr, "Invalid size %s, expected <W>x<H>\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--repeats") == 0) {
+      repeats = atoi(value);
+    } else if (strcmp(arg, "--tol") == 0) {
+      tolerance = strtod(value, nullptr);
+    } else if (strcmp(arg, "--output") == 0) {
+      output = value;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (width <= 0 || height <= 0 || repeats <= 0) {
+    fprintf(stderr, "size and repeats must be positive\n");
+    return 1;
+  }
+  for (int tile_size : tile_sizes) {
+    if (tile_size <= 0) {
+      fprintf(stderr, "tile-sizes must be positive\n");
+      return 1;
+    }
+  }
+  for (int n : degrees) {
+    if (n < 1 || n > ROOT_COLOR_COUNT) {
+      fprintf(stderr, "n must be between 1 and %d\n", ROOT_COLOR_COUNT);
+      return 1;
+    }
+  }
+  for (int max_iter : max_iters) {
+    if (max_iter <= 0 || max_iter > MAX_ITER_LIMIT) {
+      fprintf(stderr, "max-iter must be between 1 and %d\n", MAX_ITER_LIMIT);
+      return 1;
+    }
+  }
+
+  vector<Run> runs;
+  for (Mode mode : modes) {
+    bool threaded = mode == SIMD_THREADED || mode == SIMD_FUSED || mode == SIMD_SUBDIVIDE;
+    vector<int> mode_tasks = threaded ? task_counts : vector<int>{1};
+    vector<int> mode_tiles = threaded ? tile_sizes : vector<int>{DEFAULT_TILE_SIZE};
+    vector<Schedule> mode_schedules = mode == SIMD_THREADED ? schedules : vector<Schedule>{SCHEDULE_ROWS};
+    vector<int> mode_depth_tols = mode == SIMD_SUBDIVIDE ? depth_tols : vector<int>{0};
+    // The serial kernel only iterates in double
+    vector<int> mode_precisions = mode == SERIAL ? vector<int>{(int)PRECISION_DOUBLE} : precisions;
+    for (int precision : mode_precisions) {
+      for (int task_count : mode_tasks) {
+        for (int tile_size : mode_tiles) {
+          for (Schedule schedule : mode_schedules) {
+            for (int depth_tol : mode_depth_tols) {
+              for (int view : views) {
+                for (int n : degrees) {
+                  for (int max_iter : max_iters) {
+                    for (double zoom : zooms) {
+                      runs.push_back({mode, precision < 0, (Precision)max(precision, 0), task_count, tile_size, schedule, depth_tol, view, n, max_iter, zoom});
+                    }
+                  }
+                }
+              }
+            }
+          }
+        }
+      }
+    }
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "Failed to open %s\n", output);
+    return 1;
+  }
+
+  int pixel_count = width * height;
+  Grid grid = grid_alloc(pixel_count);
+  // Brute force output subdivide mode is checked against
+  Grid reference = grid_alloc(pixel_count);
+  vector<Rgba> pixels(pixel_count);
+  vector<double> seconds(repeats);
+  TileSchedule schedule;
+
+  fprintf(out, "{\n  \"isa\": \"%s\",\n  \"hardware_threads\": %u,\n  \"width\": %d,\n  \"height\": %d,\n  \"repeats\": %d,\n  \"tol\": %g,\n  \"results\": [\n",
+    target_name().c_str(), thread::hardware_concurrency(), width, height, repeats, tolerance);
+
+  for (size_t r = 0; r < runs.size(); r++) {
+    const Run& run = runs[r];
+    const Hotspot& view = HOTSPOTS[run.view];
+    // Zoom is in pixels per unit, scale it so every resolution covers the same part of the plane
+    double zoom = run.zoom * width / 4.0;
+    Precision precision = run.auto_precision ? select_precision(height, width, view.x_pos, view.y_pos, zoom, tolerance) : run.precision;
+
+    Palette palette;
+    palette_update(palette, run.n, run.max_iter, 5.0, 0.4, 0);
+
+    // Warm up caches and the task system threads, this also fills the grid for counting iterations
+    fractal(run.mode, precision, grid, height, width, view.x_pos, view.y_pos, run.n, run.max_iter, tolerance, zoom, run.task_count, run.tile_size, nullptr, run.depth_tol, Generation());
+
+    for (int i = 0; i < repeats; i++) {
+      auto before = steady_clock::now();
+      if (run.mode == SIMD_FUSED) {
+        fractal_rgba(pixels.data(), height, width, view.x_pos, view.y_pos, tolerance, zoom, precision, palette, run.task_count, run.tile_size, Generation());
+      } else {
+        const int32_t* tile_order = nullptr;
+        if (run.schedule == SCHEDULE_PREVIOUS) {
+          schedule_from_grid(schedule, grid.depth, height, width, view.x_pos, view.y_pos, zoom, height, width, view.x_pos, view.y_pos, zoom, run.tile_size);
+          tile_order = schedule_order(schedule, height, width, run.tile_size);
+        } else if (run.schedule == SCHEDULE_PROBE) {
+          schedule_from_probe(schedule, precision, height, width, view.x_pos, view.y_pos, run.n, run.max_iter, tolerance, zoom, run.task_count, run.tile_size);
+          tile_order = schedule_order(schedule, height, width, run.tile_size);
+        }
+        fractal(run.mode, precision, grid, height, width, view.x_pos, view.y_pos, run.n, run.max_iter, tolerance, zoom, run.task_count, run.tile_size, tile_order, run.depth_tol, Generation());
+      }
+      seconds[i] = duration_cast<chrono::duration<double>>(steady_clock::now() - before).count();
+    }
+    sort(seconds.begin(), seconds.end());
+
+    double p50 = percentile(seconds, 0.50);
+    double p99 = percentile(seconds, 0.99);
+    long long iterations = count_iterations(grid, pixel_count, run.max_iter);
+
+    // Subdivide runs also time the threaded kernel on the same view and count the pixels they got wrong
+    char subdivide_stats[256] = "";
+    if (run.mode == SIMD_SUBDIVIDE) {
+      vector<double> reference_seconds(repeats);
+      for (int i = 0; i < repeats; i++) {
+        auto before = steady_clock::now();
+        fractal(SIMD_THREADED, precision, reference, height, width, view.x_pos, view.y_pos, run.n, run.max_iter, tolerance, zoom, run.task_count, run.tile_size, nullptr, 0, Generation());
+        reference_seconds[i] = duration_cast<chrono::duration<double>>(steady_clock::now() - before).count();
+      }
+      sort(reference_seconds.begin(), reference_seconds.end());
+      double reference_p50 = percentile(reference_seconds, 0.50);
+      GridErrors errors = compare_grids(grid, reference, pixel_count);
+      snprintf(subdivide_stats, sizeof(subdivide_stats),
+        ", \"depth_tol\": %d, \"reference_p50_secs\": %.6f, \"speedup\": %.3f, \"root_errors\": %lld, \"depth_errors\": %lld, \"max_depth_error\": %d",
+        run.depth_tol, reference_p50, reference_p50 / p50, errors.roots, errors.depths, errors.max_depth);
+    }
+
+    // Runs in float also time the same kernel in double, with the default settings this is the speedup the
+    // automatic precision gives
+    char float_stats[128] = "";
+    if (precision == PRECISION_FLOAT) {
+      vector<double> double_seconds(repeats);
+      for (int i = 0; i < repeats; i++) {
+        auto before = steady_clock::now();
+        if (run.mode == SIMD_FUSED) {
+          fractal_rgba(pixels.data(), height, width, view.x_pos, view.y_pos, tolerance, zoom, PRECISION_DOUBLE, palette, run.task_count, run.tile_size, Generation());
+        } else {
+          fractal(run.mode, PRECISION_DOUBLE, reference, height, width, view.x_pos, view.y_pos, run.n, run.max_iter, tolerance, zoom, run.task_count, run.tile_size, nullptr, run.depth_tol, Generation());
+        }
+        double_seconds[i] = duration_cast<chrono::duration<double>>(steady_clock::now() - before).count();
+      }
+      sort(double_seconds.begin(), double_seconds.end());
+      double double_p50 = percentile(double_seconds, 0.50);
+      snprintf(float_stats, sizeof(float_stats), ", \"double_p50_secs\": %.6f, \"float_speedup\": %.3f", double_p50, double_p50 / p50);
+    }
+
+    fprintf(out,
+      "    {\"mode\": \"%s\", \"precision\": \"%s\", \"auto_precision\": %s, \"tasks\": %d, \"tile_size\": %d, \"schedule\": \"%s\", \"view\": \"%s\", \"n\": %d, \"max_iter\": %d, \"zoom\": %g, "
+      "\"p50_secs\": %.6f, \"p99_secs\": %.6f, \"min_secs\": %.6f, "
+      "\"mpixels_per_sec\": %.3f, \"giga_iterations_per_sec\": %.4f, \"iterations\": %lld%s%s}%s\n",
+      MODE_NAME[run.mode], PRECISION_NAME[precision], run.auto_precision ? "true" : "false", run.task_count, run.tile_size, SCHEDULE_NAME[run.schedule], view.name, run.n, run.max_iter, run.zoom,
+      p50, p99, seconds[0],
+      pixel_count / p50 / 1e6, iterations / p50 / 1e9, iterations, subdivide_stats, float_stats,
+      r + 1 < runs.size() ? "," : "");
+    fflush(out);
+
+    fprintf(stderr, "[%zu/%zu] %s %s tasks=%d tile=%d schedule=%s view=%s n=%d max_iter=%d zoom=%g: p50 %.2f ms\n",
+      r + 1, runs.size(), MODE_NAME[run.mode], PRECISION_NAME[precision], run.task_count, run.tile_size, SCHEDULE_NAME[run.schedule], view.name, run.n, run.max_iter, run.zoom, p50 * 1e3);
+  }
+
+  fprintf(out, "  ]\n}\n");
+  if (output) {
+    fclose(out);
+  }
+  grid_free(grid);
+  grid_free(reference);
+  return 0;
+}
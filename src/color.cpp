@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include "color.h"
+
+using namespace std;
+
+// Boundary pixels are collected and supersampled this many rows at a time, bounding the pixel list
+const int ANTIALIAS_STRIP_ROWS = 64;
+
+// raylib's RED, GREEN, BLUE, YELLOW, ORANGE, PURPLE, GRAY, PINK, DARKGREEN, DARKBLUE
+const Rgba ROOT_COLORS[] = {
+  {230, 41, 55, 255},
+  {0, 228, 48, 255},
+  {0, 121, 241, 255},
+  {253, 249, 0, 255},
+  {255, 161, 0, 255},
+  {200, 122, 255, 255},
+  {130, 130, 130, 255},
+  {255, 109, 194, 255},
+  {0, 117, 44, 255},
+  {0, 82, 172, 255},
+};
+
+const int ROOT_COLOR_COUNT = sizeof(ROOT_COLORS) / sizeof(ROOT_COLORS[0]);
+
+bool palette_update(Palette& palette, int n, int max_iter, double k, double min_brightness, int rotation) {
+  // Every root the kernels return indexes a row, an empty table would be read past its end
+  assert(n >= 1 && n <= ROOT_COLOR_COUNT);
+  if (palette.n == n && palette.max_iter == max_iter && palette.k == k && 
+      palette.min_brightness == min_brightness && palette.rotation == rotation) {
+    return false;
+  }
+  palette.n = n;
+  palette.max_iter = max_iter;
+  palette.k = k;
+  palette.min_brightness = min_brightness;
+  palette.rotation = rotation;
+
+  int row_length = max_iter + 1;
+  palette.table.resize((size_t)n * row_length);
+
+  double log_base = 1 / logf(1.0f + k);
+
+  for (int root = 0; root < n; root++) {
+    Rgba base = ROOT_COLORS[(root + rotation) % ROOT_COLOR_COUNT];
+
+    for (int depth = 0; depth <= max_iter; depth++) {
+      double normalized = static_cast<double>(depth) / max_iter;
+      double brightness = logf(1.0f + k * normalized) * log_base;
+
+      double brightness_adjusted = min_brightness + (1.0f - brightness) * brightness;
+
+      Rgba color = base;
+      color.r *= brightness_adjusted;
+      color.g *= brightness_adjusted;
+      color.b *= brightness_adjusted;
+      palette.table[root * row_length + depth] = color;
+    }
+  }
+  return true;
+}
+
+void colorize(
+    Rgba* pixels,
+    Grid grid,
+    int pixel_count,
+    const Palette& palette,
+    int task_count
+  ){
+
+  ispc::colorize_ispc(
+    (uint32_t*)pixels, 
+    grid.depth, 
+    grid.root, 
+    pixel_count, 
+    (uint32_t*)palette.table.data(), 
+    palette.max_iter + 1, 
+    task_count
+  );
+}
+
+void fractal_rgba(
+    Rgba* pixels,
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    double tol, 
+    double zoom,
+    ispc::Precision precision,
+    const Palette& palette,
+    int task_count,
+    int tile_size,
+    Generation generation
+  ){
+
+  if (precision == ispc::PRECISION_DOUBLE_DOUBLE) {
+    ispc::fractal_ispc_deep_rgba(
+      (uint32_t*)pixels, 
+      screen_height, 
+      screen_width, 
+      x_pos.hi, 
+      x_pos.lo, 
+      y_pos.hi, 
+      y_pos.lo, 
+      palette.n, 
+      palette.max_iter, 
+      tol, 
+      zoom, 
+      (uint32_t*)palette.table.data(), 
+      palette.max_iter + 1, 
+      task_count,
+      tile_size,
+      generation.ispc_latest(),
+      generation.value
+    );
+    return;
+  }
+
+  ispc::fractal_ispc_rgba(
+    (uint32_t*)pixels, 
+    screen_height, 
+    screen_width, 
+    x_pos.hi, 
+    y_pos.hi, 
+    palette.n, 
+    palette.max_iter, 
+    tol, 
+    zoom, 
+    precision, 
+    (uint32_t*)palette.table.data(), 
+    palette.max_iter + 1, 
+    task_count,
+    tile_size,
+    generation.ispc_latest(),
+    generation.value
+  );
+}
+
+long antialias(
+    Rgba* pixels,
+    Grid grid,
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    double tol, 
+    double zoom,
+    ispc::Precision precision,
+    const Palette& palette,
+    int samples,
+    int edge_depth,
+    int y0,
+    int y1,
+    int row_offset,
+    int task_count,
+    Generation generation
+  ){
+
+  samples = min(samples, MAX_AA_SAMPLES);
+  if (samples <= 1 || y0 >= y1) {
+    return 0;
+  }
+
+  vector<int32_t> edges((size_t)min(ANTIALIAS_STRIP_ROWS, y1 - y0) * screen_width);
+  long refined = 0;
+  for (int strip = y0; strip < y1 && !generation.stale(); strip += ANTIALIAS_STRIP_ROWS) {
+    int strip_end = min(strip + ANTIALIAS_STRIP_ROWS, y1);
+    int count = ispc::find_edges_ispc(grid.depth, grid.root, screen_height, screen_width, strip, strip_end, edge_depth, edges.data());
+    if (count == 0) {
+      continue;
+    }
+
+    if (precision == ispc::PRECISION_DOUBLE_DOUBLE) {
+      ispc::fractal_ispc_deep_samples(
+        (uint32_t*)pixels, 
+        edges.data(), 
+        count, 
+        screen_height, 
+        screen_width, 
+        x_pos.hi, 
+        x_pos.lo, 
+        y_pos.hi, 
+        y_pos.lo, 
+        palette.n, 
+        palette.max_iter, 
+        tol, 
+        zoom, 
+        samples, 
+        row_offset, 
+        (uint32_t*)palette.table.data(), 
+        palette.max_iter + 1, 
+        task_count,
+        generation.ispc_latest(),
+        generation.value
+      );
+    } else {
+      ispc::fractal_ispc_samples(
+        (uint32_t*)pixels, 
+        edges.data(), 
+        count, 
+        screen_height, 
+        screen_width, 
+        x_pos.hi, 
+        y_pos.hi, 
+        palette.n, 
+        palette.max_iter, 
+        tol, 
+        zoom, 
+        precision, 
+        samples, 
+        row_offset, 
+        (uint32_t*)palette.table.data(), 
+        palette.max_iter + 1, 
+        task_count,
+        generation.ispc_latest(),
+        generation.value
+      );
+    }
+    refined += count;
+  }
+  return refined;
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <vector>
+#include "fractal.h"
+
+// Same memory layout as raylib's Color, so the buffer can be handed to a texture as is
+struct Rgba {
+  unsigned char r;
+  unsigned char g;
+  unsigned char b;
+  unsigned char a;
+};
+
+static_assert(sizeof(Rgba) == sizeof(uint32_t), "Rgba is passed to ISPC as packed uint32");
+
+// Most subsamples per pixel side antialias takes, MAX_SAMPLES in tiles.isph
+const int MAX_AA_SAMPLES = 8;
+
+extern const Rgba ROOT_COLORS[];
+extern const int ROOT_COLOR_COUNT;
+
+// Lookup table from (root, depth) to the final color. Coloring a pixel is a single
+// gather, the log banding is only evaluated when one of the parameters changes
+struct Palette {
+  int n = 0;
+  int max_iter = 0;
+  double k = 0.0;
+  double min_brightness = 0.0;
+  int rotation = 0;
+
+  // n rows of max_iter + 1 colors
+  std::vector<Rgba> table;
+};
+
+// Rebuilds the table if any parameter differs from the cached ones, returns whether it did
+bool palette_update(Palette& palette, int n, int max_iter, double k, double min_brightness, int rotation);
+
+// Threaded SIMD pass applying the palette to a grid
+void colorize(
+  Rgba* pixels,
+  Grid grid,
+  int pixel_count,
+  const Palette& palette,
+  int task_count
+);
+
+// Fused compute and colorize, writes RGBA straight into pixels without an intermediate grid.
+// n and max_iter are taken from the palette
+void fractal_rgba(
+  Rgba* pixels,
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  double tol, 
+  double zoom,
+  ispc::Precision precision,
+  const Palette& palette,
+  int task_count,
+  int tile_size,
+  Generation generation
+);
+
+// Adaptive supersampling of a colored grid. The pixels in rows [y0, y1) whose root differs from one of
+// their four neighbours, or whose depth differs by more than edge_depth, get the average color of
+// samples x samples stratified subsamples. Everywhere else the single sample is kept, so the cost grows
+// with the length of the basin boundaries rather than with the area. Rows outside [y0, y1) are only
+// looked at as neighbours, row_offset is the row of the full image the grid starts at.
+// n and max_iter are taken from the palette, the grid has to be computed with them. Returns the
+// number of pixels that were supersampled
+long antialias(
+  Rgba* pixels,
+  Grid grid,
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  double tol, 
+  double zoom,
+  ispc::Precision precision,
+  const Palette& palette,
+  int samples,
+  int edge_depth,
+  int y0,
+  int y1,
+  int row_offset,
+  int task_count,
+  Generation generation
+);
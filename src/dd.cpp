@@ -0,0 +1,107 @@
+#include <cctype>
+#include "dd.h"
+
+// 2^27 + 1, splits a double into two halves whose products are exact
+static const double SPLITTER = 134217729.0;
+
+static DoubleDouble quick_two_sum(double a, double b) {
+  double s = a + b;
+  return DoubleDouble(s, b - (s - a));
+}
+
+static DoubleDouble two_sum(double a, double b) {
+  double s = a + b;
+  double bb = s - a;
+  return DoubleDouble(s, (a - (s - bb)) + (b - bb));
+}
+
+static DoubleDouble two_prod(double a, double b) {
+  double p = a * b;
+
+  double t = SPLITTER * a;
+  double a_hi = t - (t - a);
+  double a_lo = a - a_hi;
+  t = SPLITTER * b;
+  double b_hi = t - (t - b);
+  double b_lo = b - b_hi;
+
+  return DoubleDouble(p, ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo);
+}
+
+DoubleDouble operator+(DoubleDouble a, DoubleDouble b) {
+  DoubleDouble s = two_sum(a.hi, b.hi);
+  DoubleDouble t = two_sum(a.lo, b.lo);
+  s.lo += t.hi;
+  s = quick_two_sum(s.hi, s.lo);
+  s.lo += t.lo;
+  return quick_two_sum(s.hi, s.lo);
+}
+
+DoubleDouble operator-(DoubleDouble a, DoubleDouble b) {
+  return a + DoubleDouble(-b.hi, -b.lo);
+}
+
+DoubleDouble operator*(DoubleDouble a, double b) {
+  DoubleDouble p = two_prod(a.hi, b);
+  p.lo += a.lo * b;
+  return quick_two_sum(p.hi, p.lo);
+}
+
+DoubleDouble operator/(DoubleDouble a, double b) {
+  double q1 = a.hi / b;
+  DoubleDouble r = a - two_prod(q1, b);
+  double q2 = r.hi / b;
+  r = r - two_prod(q2, b);
+  double q3 = r.hi / b;
+
+  return quick_two_sum(q1, q2) + q3;
+}
+
+DoubleDouble dd_parse(const char* str) {
+  const char* c = str;
+  while (isspace(*c)) {
+    c++;
+  }
+
+  bool negative = *c == '-';
+  if (*c == '-' || *c == '+') {
+    c++;
+  }
+
+  DoubleDouble value;
+  int exponent = 0;
+  bool fraction = false;
+  for (; *c; c++) {
+    if (*c == '.') {
+      fraction = true;
+    } else if (isdigit(*c)) {
+      value = value * 10.0 + (double)(*c - '0');
+      if (fraction) {
+        exponent--;
+      }
+    } else {
+      break;
+    }
+  }
+
+  if (*c == 'e' || *c == 'E') {
+    c++;
+    bool negative_exponent = *c == '-';
+    if (*c == '-' || *c == '+') {
+      c++;
+    }
+    int written = 0;
+    for (; isdigit(*c); c++) {
+      written = written * 10 + (*c - '0');
+    }
+    exponent += negative_exponent ? -written : written;
+  }
+
+  for (; exponent > 0; exponent--) {
+    value = value * 10.0;
+  }
+  for (; exponent < 0; exponent++) {
+    value = value / 10.0;
+  }
+  return negative ? DoubleDouble(-value.hi, -value.lo) : value;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Double-double number, the unevaluated sum hi + lo with |lo| <= ulp(hi) / 2. Used for the view
+// center so it keeps moving in steps far below double epsilon at deep zoom. The operations
+// live in dd.cpp, which is compiled without -ffast-math so the error terms aren't optimized away
+struct DoubleDouble {
+  double hi;
+  double lo;
+
+  DoubleDouble(double hi = 0.0, double lo = 0.0) : hi(hi), lo(lo) {}
+};
+
+DoubleDouble operator+(DoubleDouble a, DoubleDouble b);
+DoubleDouble operator-(DoubleDouble a, DoubleDouble b);
+DoubleDouble operator*(DoubleDouble a, double b);
+DoubleDouble operator/(DoubleDouble a, double b);
+
+// Parses a decimal number keeping the digits beyond double precision, e.g. "-0.50000000000000000000123"
+DoubleDouble dd_parse(const char* str);
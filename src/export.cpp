@@ -0,0 +1,82 @@
+#include <cstdio>
+#include "export.h"
+
+using namespace std;
+
+static void encode_loop(Exporter& exporter) {
+  while (true) {
+    ExportFrame frame;
+    {
+      unique_lock<mutex> lock(exporter.lock);
+      exporter.queued.wait(lock, [&] { return !exporter.queue.empty() || exporter.stopping; });
+      // Stopping still drains the queue first
+      if (exporter.queue.empty()) {
+        return;
+      }
+      frame = move(exporter.queue.front());
+      exporter.queue.pop_front();
+      exporter.slots_taken--;
+    }
+    exporter.freed.notify_one();
+
+    if (!exporter.encoder(frame, exporter.context)) {
+      fprintf(stderr, "Failed to export frame to %s\n", frame.path.c_str());
+      lock_guard<mutex> lock(exporter.lock);
+      exporter.failed++;
+    }
+  }
+}
+
+void exporter_start(Exporter& exporter, ExportEncoder encoder, void* context, int thread_count, int capacity, ExportPolicy policy) {
+  exporter.encoder = encoder;
+  exporter.context = context;
+  exporter.policy = policy;
+  exporter.capacity = capacity;
+  exporter.stopping = false;
+  for (int i = 0; i < thread_count; i++) {
+    exporter.threads.emplace_back(encode_loop, ref(exporter));
+  }
+}
+
+bool exporter_push(Exporter& exporter, const Rgba* pixels, int width, int height, const string& path_format) {
+  int index;
+  {
+    unique_lock<mutex> lock(exporter.lock);
+    if (exporter.policy == EXPORT_BLOCK) {
+      exporter.freed.wait(lock, [&] { return exporter.slots_taken < exporter.capacity; });
+    } else if (exporter.slots_taken >= exporter.capacity) {
+      exporter.dropped++;
+      return false;
+    }
+    index = exporter.accepted++;
+    // Claims the slot now so the copy below can happen outside the lock
+    exporter.slots_taken++;
+  }
+
+  ExportFrame frame;
+  frame.pixels.assign(pixels, pixels + (size_t)width * height);
+  frame.width = width;
+  frame.height = height;
+  char path[4096];
+  snprintf(path, sizeof(path), path_format.c_str(), index);
+  frame.path = path;
+
+  {
+    lock_guard<mutex> lock(exporter.lock);
+    exporter.queue.push_back(move(frame));
+  }
+  exporter.queued.notify_one();
+  return true;
+}
+
+void exporter_stop(Exporter& exporter) {
+  {
+    lock_guard<mutex> lock(exporter.lock);
+    exporter.stopping = true;
+  }
+  exporter.queued.notify_all();
+  for (thread& thread : exporter.threads) {
+    thread.join();
+  }
+  exporter.threads.clear();
+}
@@ -0,0 +1,60 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "color.h"
+
+// What to do with a frame when every queue slot is taken
+enum ExportPolicy {
+  // Wait for an encoder to free a slot, no frame is lost but the caller stalls
+  EXPORT_BLOCK,
+  // Discard the frame and count it in dropped, the caller never waits
+  EXPORT_DROP
+};
+
+// A copy of a finished frame, owned by the queue until it has been encoded
+struct ExportFrame {
+  std::vector<Rgba> pixels;
+  int width = 0;
+  int height = 0;
+  std::string path;
+};
+
+// Writes one frame, called on the encoder threads with the context given to exporter_start.
+// With a single encoder thread frames arrive in the order they were pushed, as streams need them
+typedef bool (*ExportEncoder)(const ExportFrame& frame, void* context);
+
+// Bounded queue of frames drained by a pool of encoder threads, so encoding never runs on the
+// thread that produces the frames
+struct Exporter {
+  ExportEncoder encoder = nullptr;
+  void* context = nullptr;
+  ExportPolicy policy = EXPORT_DROP;
+  int capacity = 0;
+
+  std::mutex lock;
+  std::condition_variable queued;
+  std::condition_variable freed;
+  std::deque<ExportFrame> queue;
+  // Queued frames plus the ones still being copied in, never more than capacity
+  int slots_taken = 0;
+  bool stopping = false;
+  // Frames accepted so far, numbers the output files without gaps for dropped ones
+  int accepted = 0;
+  int dropped = 0;
+  int failed = 0;
+
+  std::vector<std::thread> threads;
+};
+
+void exporter_start(Exporter& exporter, ExportEncoder encoder, void* context, int thread_count, int capacity, ExportPolicy policy);
+
+// Copies the frame into the queue. path_format is a printf format receiving the frame number,
+// returns false when the frame was dropped
+bool exporter_push(Exporter& exporter, const Rgba* pixels, int width, int height, const std::string& path_format);
+
+// Encodes whatever is still queued and joins the encoder threads
+void exporter_stop(Exporter& exporter);
@@ -1,9 +1,129 @@
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
 #include "fractal.h"
 
 using namespace std;
 
-void fractal_cpp(
-    ispc::Point* grid, 
+// Rounded up to whole cache lines, aligned_alloc wants a multiple of the alignment
+static size_t aligned_size(size_t size) {
+  return (size + 63) & ~(size_t)63;
+}
+
+Grid grid_alloc(size_t pixel_count) {
+  Grid grid;
+  grid.depth = (uint16_t*) std::aligned_alloc(64, aligned_size(pixel_count * sizeof(uint16_t)));
+  grid.root = (uint8_t*) std::aligned_alloc(64, aligned_size(pixel_count * sizeof(uint8_t)));
+  return grid;
+}
+
+void grid_free(Grid& grid) {
+  std::free(grid.depth);
+  std::free(grid.root);
+  grid.depth = nullptr;
+  grid.root = nullptr;
+}
+
+void grid_copy(Grid to, Grid from, int pixel_count) {
+  memcpy(to.depth, from.depth, pixel_count * sizeof(uint16_t));
+  memcpy(to.root, from.root, pixel_count * sizeof(uint8_t));
+}
+
+void grid_shift(Grid grid, int screen_height, int screen_width, int dx, int dy) {
+  int row_length = screen_width - abs(dx);
+  int x_start = max(0, -dx);
+  int y_start = max(0, -dy);
+  int y_end = min(screen_height, screen_height - dy);
+
+  // Rows are moved in the order that never overwrites a row before it was read
+  for (int i = 0; i < y_end - y_start; i++) {
+    int y = dy > 0 ? y_start + i : y_end - 1 - i;
+    int to = y * screen_width + x_start;
+    int from = (y + dy) * screen_width + x_start + dx;
+    memmove(grid.depth + to, grid.depth + from, row_length * sizeof(uint16_t));
+    memmove(grid.root + to, grid.root + from, row_length * sizeof(uint8_t));
+  }
+}
+
+// z^N as a chain of squarings, unrolled at compile time
+template <int N>
+static inline Complex power(Complex z) {
+  if constexpr (N == 0) {
+    return Complex(1, 0);
+  } else if constexpr (N % 2 == 0) {
+    Complex half = power<N / 2>(z);
+    return half * half;
+  } else {
+    return power<N - 1>(z) * z;
+  }
+}
+
+// Newton iteration for z^N - 1. The step z - (z^N - 1) / (N z^(N-1)) is rewritten as
+// ((N-1) z^N + 1) / (N z^(N-1)), and the division as a multiply by the conjugate
+template <int N>
+static inline int newton(Complex& z, int max_iter, double tol) {
+  double tol_squared = tol * tol;
+
+  int depth = 0;
+  for (; depth < max_iter; depth++) {
+    Complex zpow = power<N - 1>(z);
+    Complex numer = (double)(N - 1) * (z * zpow) + 1.0;
+    Complex next = numer * conj(zpow) / (N * norm(zpow));
+
+    if (norm(z - next) < tol_squared) {
+      break;
+    }
+    z = next;
+  }
+  return depth;
+}
+
+// Any other degree, with the power computed at runtime
+static int newton_generic(Complex& z, int n, int max_iter, double tol) {
+  Complex cf = Complex(1,0);
+  Complex cfprime = Complex(n,0);
+
+  int depth = 0;
+  for (; depth < max_iter; depth++) {
+
+    Complex zpow = pow(z, n-1);
+    Complex f = z * zpow - cf;
+    Complex fprime = cfprime * zpow;
+
+    Complex dz =  f / fprime;
+
+    if (abs(dz) < tol) {
+      break;
+    }
+    z -= dz;
+  }
+  return depth;
+}
+
+// -Ofast assumes there are no NaNs, so the exponent bits are checked instead of calling isfinite
+static bool finite_bits(double value) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  return (bits & 0x7ff0000000000000ull) != 0x7ff0000000000000ull;
+}
+
+// Sector of the plane z lies in. The pixel at z = 0 iterates to NaN and gets root 0, any root
+// has to index a palette row
+static int nearest_root(Complex z, int n) {
+  if (!finite_bits(z.real()) || !finite_bits(z.imag())) {
+    return 0;
+  }
+  return clamp((int)((arg(z) + M_PI) / (2*M_PI/n)) % n, 0, n - 1);
+}
+
+// Degree 0 stands for the generic iteration, the others ignore n
+template <int N>
+static void fractal_cpp_degree(
+    Grid grid, 
     int screen_height, 
     int screen_width,     
     double x_pos, 
@@ -11,39 +131,275 @@ void fractal_cpp(
     int n, 
     int max_iter, 
     double tol, 
-    double zoom
+    double zoom,
+    Generation generation
   ){
 
   double plane_width = screen_width / zoom;
   double plane_height = screen_height / zoom; 
   
-  Complex cf = Complex(1,0);
-  Complex cfprime = Complex(n,0);
-  
   for (int y = 0; y < screen_height; y++) {
+    // Checked per row, the serial kernel has no tiles
+    if (generation.stale()) {
+      return;
+    }
     for (int x = 0; x < screen_width; x++) {
       
       int depth = 0;
-      int nearest_root = 0;
 
       double real = ((double)x / screen_width - 0.5) * plane_width + x_pos;
       double imag = ((double)y / screen_height - 0.5) * plane_height + y_pos;
       Complex z(real, imag);
-      for (; depth < max_iter; depth++) {
+      if constexpr (N == 0) {
+        depth = newton_generic(z, n, max_iter, tol);
+      } else {
+        depth = newton<N>(z, max_iter, tol);
+      }
+      grid.depth[y * screen_width + x] = depth;
+      grid.root[y * screen_width + x] = nearest_root(z, n);
+    }
+  }
+}
 
-        Complex zpow = pow(z, n-1);
-        Complex f = z * zpow - cf;
-        Complex fprime = cfprime * zpow;
+typedef void (*FractalCppKernel)(Grid, int, int, double, double, int, int, double, double, Generation);
 
-        Complex dz =  f / fprime;
+// Indexed by n, degrees past the end take the generic kernel
+static const FractalCppKernel FRACTAL_CPP_KERNELS[] = {
+  fractal_cpp_degree<0>,
+  fractal_cpp_degree<1>,
+  fractal_cpp_degree<2>,
+  fractal_cpp_degree<3>,
+  fractal_cpp_degree<4>,
+  fractal_cpp_degree<5>,
+  fractal_cpp_degree<6>,
+  fractal_cpp_degree<7>,
+  fractal_cpp_degree<8>,
+  fractal_cpp_degree<9>,
+  fractal_cpp_degree<10>,
+};
 
-        if (abs(dz) < tol) {
-          break;
-        }
-        z -= dz;
-      }
-      nearest_root = (int)((arg(z) + M_PI) / (2*M_PI/n))  % n; 
-      grid[y * screen_width + x] = {depth, nearest_root};
+void fractal_cpp(
+    Grid grid, 
+    int screen_height, 
+    int screen_width,     
+    double x_pos, 
+    double y_pos, 
+    int n, 
+    int max_iter, 
+    double tol, 
+    double zoom,
+    Generation generation
+  ){
+
+  int kernel_count = sizeof(FRACTAL_CPP_KERNELS) / sizeof(FRACTAL_CPP_KERNELS[0]);
+  FractalCppKernel kernel = n > 0 && n < kernel_count ? FRACTAL_CPP_KERNELS[n] : FRACTAL_CPP_KERNELS[0];
+  kernel(grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, generation);
+}
+
+void fractal(
+    Mode mode,
+    ispc::Precision precision,
+    Grid grid, 
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    int n, 
+    int max_iter, 
+    double tol, 
+    double zoom,
+    int task_count,
+    int tile_size,
+    const int32_t* tile_order,
+    int depth_tol,
+    Generation generation
+  ){
+
+  if (mode == SERIAL) {
+    fractal_cpp(grid, screen_height, screen_width, x_pos.hi, y_pos.hi, n, max_iter, tol, zoom, generation);
+    return;
+  }
+
+  if (mode == SIMD) {
+    task_count = 1;
+  }
+
+  if (precision == ispc::PRECISION_DOUBLE_DOUBLE) {
+    ispc::fractal_ispc_deep(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, x_pos.lo, y_pos.hi, y_pos.lo, n, max_iter, tol, zoom, task_count, tile_size, tile_order, generation.ispc_latest(), generation.value);
+  } else if (mode == SIMD_SUBDIVIDE) {
+    ispc::fractal_ispc_subdivide(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, y_pos.hi, n, max_iter, tol, zoom, precision, depth_tol, task_count, tile_size, generation.ispc_latest(), generation.value);
+  } else {
+    ispc::fractal_ispc(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, y_pos.hi, n, max_iter, tol, zoom, precision, task_count, tile_size, tile_order, generation.ispc_latest(), generation.value);
+  }
+}
+
+void fractal_pass(
+    Mode mode,
+    ispc::Precision precision,
+    Grid grid, 
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    int n, 
+    int max_iter, 
+    double tol, 
+    double zoom,
+    int stride,
+    int task_count,
+    int tile_size,
+    const int32_t* tile_order,
+    Generation generation
+  ){
+
+  if (mode == SIMD) {
+    task_count = 1;
+  }
+  // Tiles have to line up with the coarsest lattice, an order for other tiles doesn't apply
+  int lattice_tile_size = (tile_size + PROGRESSIVE_STRIDE - 1) / PROGRESSIVE_STRIDE * PROGRESSIVE_STRIDE;
+  if (lattice_tile_size != tile_size) {
+    tile_size = lattice_tile_size;
+    tile_order = nullptr;
+  }
+  bool refine = stride < PROGRESSIVE_STRIDE;
+
+  if (precision == ispc::PRECISION_DOUBLE_DOUBLE) {
+    ispc::fractal_ispc_deep_pass(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, x_pos.lo, y_pos.hi, y_pos.lo, n, max_iter, tol, zoom, stride, refine, task_count, tile_size, tile_order, generation.ispc_latest(), generation.value);
+  } else {
+    ispc::fractal_ispc_pass(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, y_pos.hi, n, max_iter, tol, zoom, precision, stride, refine, task_count, tile_size, tile_order, generation.ispc_latest(), generation.value);
+  }
+}
+
+void fractal_region(
+    ispc::Precision precision,
+    Grid grid, 
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    int n, 
+    int max_iter, 
+    double tol, 
+    double zoom,
+    int x0,
+    int y0,
+    int x1,
+    int y1,
+    int task_count,
+    int tile_size,
+    Generation generation
+  ){
+
+  if (x0 >= x1 || y0 >= y1) {
+    return;
+  }
+  if (precision == ispc::PRECISION_DOUBLE_DOUBLE) {
+    ispc::fractal_ispc_deep_region(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, x_pos.lo, y_pos.hi, y_pos.lo, n, max_iter, tol, zoom, x0, y0, x1, y1, task_count, tile_size, generation.ispc_latest(), generation.value);
+  } else {
+    ispc::fractal_ispc_region(grid.depth, grid.root, screen_height, screen_width, x_pos.hi, y_pos.hi, n, max_iter, tol, zoom, precision, x0, y0, x1, y1, task_count, tile_size, generation.ispc_latest(), generation.value);
+  }
+}
+
+void fractal_pan(
+    Mode mode,
+    ispc::Precision precision,
+    Grid grid, 
+    int screen_height, 
+    int screen_width,     
+    DoubleDouble x_pos, 
+    DoubleDouble y_pos, 
+    int n, 
+    int max_iter, 
+    double tol, 
+    double zoom,
+    int dx,
+    int dy,
+    int task_count,
+    int tile_size,
+    Generation generation
+  ){
+
+  if (mode == SIMD) {
+    task_count = 1;
+  }
+  grid_shift(grid, screen_height, screen_width, dx, dy);
+
+  // Exposed columns over the full height, then the exposed rows between them
+  int known_x0 = max(0, -dx);
+  int known_x1 = min(screen_width, screen_width - dx);
+  if (dx > 0) {
+    fractal_region(precision, grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, known_x1, 0, screen_width, screen_height, task_count, tile_size, generation);
+  } else if (dx < 0) {
+    fractal_region(precision, grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, 0, 0, known_x0, screen_height, task_count, tile_size, generation);
+  }
+  if (dy > 0) {
+    fractal_region(precision, grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, known_x0, screen_height - dy, known_x1, screen_height, task_count, tile_size, generation);
+  } else if (dy < 0) {
+    fractal_region(precision, grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, known_x0, 0, known_x1, -dy, task_count, tile_size, generation);
+  }
+}
+
+int default_task_count() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+bool parse_mode(const char* name, Mode* mode) {
+  for (int i = 0; i < (int)(sizeof(MODE_NAME) / sizeof(MODE_NAME[0])); i++) {
+    if (strcmp(name, MODE_NAME[i]) == 0) {
+      *mode = (Mode)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+ispc::Precision select_precision(int screen_height, int screen_width, double x_pos, double y_pos, double zoom, double tol) {
+  double pixel_spacing = 1.0 / zoom;
+  double extent = max(fabs(x_pos), fabs(y_pos)) + max(screen_width, screen_height) * 0.5 * pixel_spacing;
+  double float_ulp = max(extent, 1.0) * FLT_EPSILON;
+  double double_ulp = max(extent, 1.0) * DBL_EPSILON;
+
+  if (pixel_spacing >= FLOAT_MIN_ULPS_PER_PIXEL * float_ulp && tol >= FLOAT_TOL_FLOOR) {
+    return ispc::PRECISION_FLOAT;
+  }
+  if (pixel_spacing < DOUBLE_MIN_ULPS_PER_PIXEL * double_ulp) {
+    return ispc::PRECISION_DOUBLE_DOUBLE;
+  }
+  return ispc::PRECISION_DOUBLE;
+}
+
+bool parse_precision(const char* name, ispc::Precision* precision, bool* automatic) {
+  if (strcmp(name, "auto") == 0) {
+    *automatic = true;
+    return true;
+  }
+  for (int i = 0; i < (int)(sizeof(PRECISION_NAME) / sizeof(PRECISION_NAME[0])); i++) {
+    if (strcmp(name, PRECISION_NAME[i]) == 0) {
+      *precision = (ispc::Precision)i;
+      *automatic = false;
+      return true;
+    }
+  }
+  return false;
+}
+
+std::string target_name() {
+  return std::string(ISA_NAME[ispc::target_isa()]) + "-x" + std::to_string(ispc::target_width());
+}
+
+std::string json_escape(const std::string& text) {
+  std::string escaped;
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      escaped += '\\';
+      escaped += (char)c;
+    } else if (c < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", c);
+      escaped += code;
+    } else {
+      escaped += (char)c;
     }
   }
-}
\ No newline at end of file
+  return escaped;
+}
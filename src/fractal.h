@@ -1,10 +1,132 @@
+#pragma once
+#include <atomic>
 #include <complex>
+#include <cstdint>
+#include <string>
 #include "fractal_ispc.h"
+#include "deep_ispc.h"
+#include "dd.h"
 
 typedef std::complex<double> Complex;
 
+// Depths are stored as uint16, so max_iter can't go beyond this
+const int MAX_ITER_LIMIT = UINT16_MAX;
+
+// Side of the square tiles the threaded kernels hand out to their tasks. Small enough that the
+// slow tiles along basin boundaries spread over all threads, large enough to amortize the atomic
+const int DEFAULT_TILE_SIZE = 32;
+
+// Stride of the first pass of progressive rendering, later passes halve it down to 1
+const int PROGRESSIVE_STRIDE = 8;
+
+// One task per hardware thread, tiles are claimed dynamically so more tasks don't balance better
+int default_task_count();
+
+// Lets a caller abandon a frame that is still being computed. A kernel started for value stops
+// claiming tiles once *latest holds anything else, the pixels it didn't get to keep their old
+// contents. The default never goes stale
+struct Generation {
+  const std::atomic<int32_t>* latest = nullptr;
+  int32_t value = 0;
+
+  bool stale() const {
+    return latest && latest->load(std::memory_order_acquire) != value;
+  }
+
+  // The kernels read the counter as a plain int32
+  int32_t* ispc_latest() const {
+    return (int32_t*)latest;
+  }
+};
+
+static_assert(sizeof(std::atomic<int32_t>) == sizeof(int32_t), "Generation::latest is read by ISPC as int32");
+
+// Kernel output as separate planes, both row major with one entry per pixel
+struct Grid {
+  uint16_t* depth;
+  uint8_t* root;
+};
+
+// The kernels index grids with 32 bit ints, a grid holds at most this many pixels
+const int64_t MAX_GRID_PIXELS = INT32_MAX;
+
+Grid grid_alloc(size_t pixel_count);
+void grid_free(Grid& grid);
+
+// Moves the grid contents so the new pixel (x, y) holds the old pixel (x + dx, y + dy). The
+// dx x height and width x dy strips that were shifted in keep stale values
+void grid_shift(Grid grid, int screen_height, int screen_width, int dx, int dy);
+
+void grid_copy(Grid to, Grid from, int pixel_count);
+
+enum Mode {
+  SERIAL,
+  SIMD,
+  SIMD_THREADED,
+  SIMD_FUSED,
+  SIMD_SUBDIVIDE
+};
+
+const char* const MODE_STRING[] = {
+  "Serial",
+  "SIMD",
+  "SIMD Threaded",
+  "SIMD Fused",
+  "SIMD Subdivide"
+};
+
+// Short names used on the command line and in machine readable output
+const char* const MODE_NAME[] = {
+  "serial",
+  "simd",
+  "threaded",
+  "fused",
+  "subdivide"
+};
+
+bool parse_mode(const char* name, Mode* mode);
+
+// Indexed by ispc::target_isa()
+const char* const ISA_NAME[] = {
+  "other",
+  "sse2",
+  "sse4",
+  "avx",
+  "avx2",
+  "avx512skx"
+};
+
+// ISA and gang size the ISPC dispatcher picked on this CPU, e.g. "avx2-x8"
+std::string target_name();
+
+// text as the contents of a JSON string, for the paths the tools print in their JSON lines
+std::string json_escape(const std::string& text);
+
+const char* const PRECISION_NAME[] = {
+  "float",
+  "double",
+  "double-double"
+};
+
+// Float is only used when a pixel spans at least this many float ulps of the largest coordinate in view
+const double FLOAT_MIN_ULPS_PER_PIXEL = 64.0;
+// Below this many double ulps per pixel the deep zoom kernels take over
+const double DOUBLE_MIN_ULPS_PER_PIXEL = 16.0;
+// Smallest tolerance the float kernels iterate to, FLOAT_TOL_FLOOR in fractal.ispc. Tighter tolerances
+// need double
+const double FLOAT_TOL_FLOOR = 2.4e-7;
+// Convergence tolerance of all tools, as tight as float allows so the float kernels can be picked
+const double DEFAULT_TOLERANCE = FLOAT_TOL_FLOOR;
+
+// Picks the cheapest precision that still tells neighbouring pixels apart and can resolve tol.
+// Only the leading part of the view center matters for the choice
+ispc::Precision select_precision(int screen_height, int screen_width, double x_pos, double y_pos, double zoom, double tol);
+
+// Accepts the PRECISION_NAME entries, and "auto" which leaves the choice to select_precision
+bool parse_precision(const char* name, ispc::Precision* precision, bool* automatic);
+
 void fractal_cpp(
-  ispc::Point* grid, 
+  Grid grid, 
   int screen_height, 
   int screen_width,     
   double x_pos, 
@@ -12,5 +134,100 @@ void fractal_cpp(
   int n, 
   int max_iter, 
   double tol, 
-  double zoom
-);
\ No newline at end of file
+  double zoom,
+  Generation generation
+);
+
+// Runs the kernel belonging to mode, task_count and tile_size are only used by the threaded modes.
+// tile_order is the order the tiles are claimed in, see schedule.h, or NULL for row major. It has to
+// be built for this view size and tile_size, SIMD_SUBDIVIDE ignores it.
+// SIMD_FUSED has no grid output, here it runs the SIMD_THREADED kernel, see fractal_rgba.
+// SIMD_SUBDIVIDE fills rectangles whose border agrees on the root and on the depth within
+// depth_tol without iterating them. It has no double-double kernel and runs the threaded one there.
+// The serial kernel always iterates in double around x_pos.hi, precision only applies to the ISPC ones
+void fractal(
+  Mode mode,
+  ispc::Precision precision,
+  Grid grid, 
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  int n, 
+  int max_iter, 
+  double tol, 
+  double zoom,
+  int task_count,
+  int tile_size,
+  const int32_t* tile_order,
+  int depth_tol,
+  Generation generation
+);
+
+// One pass of progressive rendering with the SIMD or SIMD_THREADED kernel. The first pass at
+// PROGRESSIVE_STRIDE computes every stride-th pixel and fills the block around it, passes at half
+// the previous stride only compute the samples that are new, after the pass at stride 1 the grid
+// matches what fractal() computes. tile_order as for fractal(), it is ignored unless tile_size is a
+// multiple of PROGRESSIVE_STRIDE
+void fractal_pass(
+  Mode mode,
+  ispc::Precision precision,
+  Grid grid, 
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  int n, 
+  int max_iter, 
+  double tol, 
+  double zoom,
+  int stride,
+  int task_count,
+  int tile_size,
+  const int32_t* tile_order,
+  Generation generation
+);
+
+// Computes the pixels in [x0, x1) x [y0, y1) of the view with the SIMD_THREADED kernels, the rest
+// of the grid is left as it is
+void fractal_region(
+  ispc::Precision precision,
+  Grid grid, 
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  int n, 
+  int max_iter, 
+  double tol, 
+  double zoom,
+  int x0,
+  int y0,
+  int x1,
+  int y1,
+  int task_count,
+  int tile_size,
+  Generation generation
+);
+
+// Pans the grid by whole pixels, x_pos and y_pos are the position after the pan. Shifts the
+// known pixels with grid_shift and only computes the exposed strips with the SIMD or
+// SIMD_THREADED kernel. |dx| and |dy| have to be smaller than the screen
+void fractal_pan(
+  Mode mode,
+  ispc::Precision precision,
+  Grid grid, 
+  int screen_height, 
+  int screen_width,     
+  DoubleDouble x_pos, 
+  DoubleDouble y_pos, 
+  int n, 
+  int max_iter, 
+  double tol, 
+  double zoom,
+  int dx,
+  int dy,
+  int task_count,
+  int tile_size,
+  Generation generation
+);
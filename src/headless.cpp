@@ -0,0 +1,471 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "fractal.h"
+#include "color.h"
+#include "video.h"
+#include "tiff.h"
+#include "schedule.h"
+#include "trace.h"
+
+using namespace std;
+using namespace chrono;
+using namespace ispc;
+
+void usage(const char* program) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  --x <number>          view center real part, digits beyond double precision are kept (default 0)\n"
+    "  --y <number>          view center imaginary part (default 0)\n"
+    "  --zoom <double>       pixels per unit (default 1)\n"
+    "  --n <int>             polynomial degree of z^n - 1 (default 3)\n"
+    "  --max-iter <int>      max Newton iterations (default 75)\n"
+    "  --tol <double>        convergence tolerance (default 2.4e-7)\n"
+    "  --size <W>x<H>        output resolution (default 1024x1024)\n"
+    "  --mode <serial|simd|threaded|fused|subdivide>  kernel to run, fused colors inside the kernel (default threaded)\n"
+    "  --tasks <int>         task count for the threaded modes (default one per hardware thread)\n"
+    "  --tile-size <int>     side of the square tiles the tasks claim (default 32)\n"
+    "  --depth-tol <int>     subdivide mode fills rectangles whose border depths are this close (default 0)\n"
+    "  --precision <auto|float|double|double-double>  iteration precision of the ISPC kernels (default auto)\n"
+    "  --schedule <rows|probe>  order the threaded tasks claim tiles in, probe computes a 1/64 preview first and\n"
+    "                        claims the tiles it predicts to be expensive first (default rows)\n"
+    "  --output <path>       .ppm for a colored image, .raw for the depth/root grid, .tif for a tiled BigTIFF\n"
+    "                        rendered in bands of 256 rows, for images larger than memory (default fractal.ppm)\n"
+    "  --aa <int>            supersamples pixels along basin boundaries with aa x aa subsamples, up to 8 (default 1, off)\n"
+    "  --aa-depth <int>      depth difference to a neighbour that also counts as a boundary for --aa (default 2)\n"
+    "  --trace <path>        records every task, tile, sync and idle span and writes them as Chrome trace JSON\n"
+    "  --k <double>          color banding strength (default 5)\n"
+    "  --min-brightness <double>  (default 0.4)\n",
+    program);
+}
+
+bool ends_with(const string& str, const string& suffix) {
+  return str.size() >= suffix.size() && str.compare(str.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Raw dump of the grid, the uint16 depth plane followed by the uint8 root plane, native endian
+bool write_raw(const string& path, Grid grid, int width, int height) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  fwrite(grid.depth, sizeof(uint16_t), (size_t)width * height, file);
+  fwrite(grid.root, sizeof(uint8_t), (size_t)width * height, file);
+  return fclose(file) == 0;
+}
+
+// Everything the image depends on, a checkpoint written for other parameters is ignored
+string checkpoint_key(
+  int width,
+  int height,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  double zoom,
+  int n,
+  int max_iter,
+  double tolerance,
+  Mode mode,
+  Precision precision,
+  int depth_tol,
+  int aa_samples,
+  int aa_depth,
+  double k,
+  double min_brightness
+  ){
+  char key[512];
+  snprintf(key, sizeof(key), "%d %d %a %a %a %a %a %d %d %a %s %s %d %d %d %a %a", width, height, x_pos.hi, x_pos.lo, y_pos.hi, y_pos.lo, zoom, n, max_iter,
+    tolerance, MODE_NAME[mode], PRECISION_NAME[precision], depth_tol, aa_samples, aa_depth, k, min_brightness);
+  return key;
+}
+
+// Bands finished by an earlier run with the same key, 0 if there is none
+int read_checkpoint(const string& path, const string& key) {
+  FILE* file = fopen(path.c_str(), "r");
+  if (!file) {
+    return 0;
+  }
+  char line[512];
+  int bands = 0;
+  if (!fgets(line, sizeof(line), file) || key + "\n" != line || fscanf(file, "%d", &bands) != 1) {
+    bands = 0;
+  }
+  fclose(file);
+  return bands;
+}
+
+// Replaced through a rename, so an interrupted write leaves the previous checkpoint
+bool write_checkpoint(const string& path, const string& key, int bands) {
+  string temporary = path + ".tmp";
+  FILE* file = fopen(temporary.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "%s\n%d\n", key.c_str(), bands);
+  if (fclose(file) != 0) {
+    return false;
+  }
+  return rename(temporary.c_str(), path.c_str()) == 0;
+}
+
+// Renders the image one band of TIFF_TILE_SIZE rows at a time, memory stays at a few bands however
+// large the image is. Every band is computed over all tasks while the previous one is written on a
+// separate thread. After each band is on disk the checkpoint next to the output is updated, a run
+// with the same parameters continues after the last finished band. With supersampling every band
+// also computes the image rows right above and below it, so the boundaries found along the band
+// edges are the same as in the whole image
+bool render_tiled(
+  const string& output,
+  int width,
+  int height,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  double zoom,
+  int n,
+  int max_iter,
+  double tolerance,
+  Mode mode,
+  Precision precision,
+  int task_count,
+  int tile_size,
+  bool probe,
+  int depth_tol,
+  int aa_samples,
+  int aa_depth,
+  const Palette& palette,
+  const string& key,
+  int* resumed_bands,
+  long* aa_pixels,
+  double* write_secs
+  ){
+  string checkpoint = output + ".checkpoint";
+  int band_count = (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+  int first_band = read_checkpoint(checkpoint, key);
+
+  TiffWriter writer;
+  if (first_band > 0 && !tiff_open(writer, output, width, height, true)) {
+    first_band = 0;
+  }
+  if (first_band == 0 && !tiff_open(writer, output, width, height, false)) {
+    return false;
+  }
+  *resumed_bands = first_band;
+
+  size_t band_pixels = (size_t)width * (TIFF_TILE_SIZE + 2);
+  Grid grid = grid_alloc(band_pixels);
+  TileSchedule schedule;
+  vector<Rgba> pixels[2];
+  pixels[0].resize(band_pixels);
+  pixels[1].resize(band_pixels);
+
+  thread writer_thread;
+  bool written = true;
+  auto finish_write = [&]() {
+    if (writer_thread.joinable()) {
+      auto wait_before = steady_clock::now();
+      writer_thread.join();
+      *write_secs += duration_cast<chrono::duration<double>>(steady_clock::now() - wait_before).count();
+    }
+  };
+
+  for (int band = first_band; band < band_count; band++) {
+    int rows = min(TIFF_TILE_SIZE, height - band * TIFF_TILE_SIZE);
+    int above = aa_samples > 1 && band > 0 ? 1 : 0;
+    int below = aa_samples > 1 && band < band_count - 1 ? 1 : 0;
+    int first_row = band * TIFF_TILE_SIZE - above;
+    int band_rows = above + rows + below;
+    // The band is a view of its own, centered so its pixels land where they are in the full image
+    DoubleDouble band_y = y_pos + DoubleDouble(first_row + band_rows * 0.5 - height * 0.5) / zoom;
+    vector<Rgba>& band_rgba = pixels[band % 2];
+
+    if (mode == SIMD_FUSED) {
+      fractal_rgba(band_rgba.data(), band_rows, width, x_pos, band_y, tolerance, zoom, precision, palette, task_count, tile_size, Generation());
+    } else {
+      const int32_t* tile_order = nullptr;
+      if (probe) {
+        schedule_from_probe(schedule, precision, band_rows, width, x_pos, band_y, n, max_iter, tolerance, zoom, task_count, tile_size);
+        tile_order = schedule_order(schedule, band_rows, width, tile_size);
+      }
+      fractal(mode, precision, grid, band_rows, width, x_pos, band_y, n, max_iter, tolerance, zoom, task_count, tile_size, tile_order, depth_tol, Generation());
+      colorize(band_rgba.data(), grid, band_rows * width, palette, task_count);
+      *aa_pixels += antialias(band_rgba.data(), grid, band_rows, width, x_pos, band_y, tolerance, zoom, precision, palette, aa_samples, aa_depth,
+        above, above + rows, first_row, task_count, Generation());
+    }
+
+    finish_write();
+    if (!written) {
+      break;
+    }
+    writer_thread = thread([&, band, above]() {
+      written = tiff_write_tile_row(writer, band, pixels[band % 2].data() + (size_t)above * width) && tiff_sync(writer) &&
+        write_checkpoint(checkpoint, key, band + 1);
+    });
+  }
+  finish_write();
+  grid_free(grid);
+
+  written = tiff_close(writer) && written;
+  if (written) {
+    remove(checkpoint.c_str());
+  }
+  return written;
+}
+
+// Stops tracing and writes what was recorded, nothing to do without a trace path
+bool write_trace(const string& path) {
+  if (path.empty()) {
+    return true;
+  }
+  trace_stop();
+  if (!trace_write_json(path)) {
+    fprintf(stderr, "Failed to write %s\n", path.c_str());
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  DoubleDouble x_pos = 0.0;
+  DoubleDouble y_pos = 0.0;
+  double zoom = 1.0;
+  int n = 3;
+  int max_iter = 75;
+  double tolerance = DEFAULT_TOLERANCE;
+  int width = 1024;
+  int height = 1024;
+  Mode mode = SIMD_THREADED;
+  int task_count = default_task_count();
+  int tile_size = DEFAULT_TILE_SIZE;
+  int depth_tol = 0;
+  int aa_samples = 1;
+  int aa_depth = 2;
+  Precision precision = PRECISION_DOUBLE;
+  bool auto_precision = true;
+  string output = "fractal.ppm";
+  string trace_path;
+  bool probe = false;
+  double k = 5.0;
+  double min_brightness = 0.4;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if (strcmp(arg, "--x") == 0) {
+      x_pos = dd_parse(value);
+    } else if (strcmp(arg, "--y") == 0) {
+      y_pos = dd_parse(value);
+    } else if (strcmp(arg, "--zoom") == 0) {
+      zoom = strtod(value, nullptr);
+    } else if (strcmp(arg, "--n") == 0) {
+      n = atoi(value);
+    } else if (strcmp(arg, "--max-iter") == 0) {
+      max_iter = atoi(value);
+    } else if (strcmp(arg, "--tol") == 0) {
+      tolerance = strtod(value, nullptr);
+    } else if (strcmp(arg, "--size") == 0) {
+      if (sscanf(value, "%dx%d", &width, &height) != 2) {
+        fprintf(stderr, "Invalid size %s, expected <W>x<H>\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--mode") == 0) {
+      if (!parse_mode(value, &mode)) {
+        fprintf(stderr, "Unknown mode %s\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--tasks") == 0) {
+      task_count = atoi(value);
+    } else if (strcmp(arg, "--tile-size") == 0) {
+      tile_size = atoi(value);
+    } else if (strcmp(arg, "--depth-tol") == 0) {
+      depth_tol = atoi(value);
+    } else if (strcmp(arg, "--precision") == 0) {
+      if (!parse_precision(value, &precision, &auto_precision)) {
+        fprintf(stderr, "Unknown precision %s\n", value);
+        return 1;
+      }
+    } else if (strcmp(arg, "--schedule") == 0) {
+      if (strcmp(value, "rows") != 0 && strcmp(value, "probe") != 0) {
+        fprintf(stderr, "Unknown schedule %s\n", value);
+        return 1;
+      }
+      probe = strcmp(value, "probe") == 0;
+    } else if (strcmp(arg, "--output") == 0) {
+      output = value;
+    } else if (strcmp(arg, "--aa") == 0) {
+      aa_samples = atoi(value);
+    } else if (strcmp(arg, "--aa-depth") == 0) {
+      aa_depth = atoi(value);
+    } else if (strcmp(arg, "--trace") == 0) {
+      trace_path = value;
+    } else if (strcmp(arg, "--k") == 0) {
+      k = strtod(value, nullptr);
+    } else if (strcmp(arg, "--min-brightness") == 0) {
+      min_brightness = strtod(value, nullptr);
+    } else {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (n < 1 || n > ROOT_COLOR_COUNT) {
+    fprintf(stderr, "n must be between 1 and %d\n", ROOT_COLOR_COUNT);
+    return 1;
+  }
+  if (width <= 0 || height <= 0 || max_iter <= 0 || task_count <= 0 || tile_size <= 0 || zoom <= 0.0) {
+    fprintf(stderr, "size, max-iter, tasks, tile-size and zoom must be positive\n");
+    return 1;
+  }
+  if (depth_tol < 0) {
+    fprintf(stderr, "depth-tol can't be negative\n");
+    return 1;
+  }
+  // Only the .tif output is rendered in bands, the others need a grid of the whole image
+  bool tiled = ends_with(output, ".tif") || ends_with(output, ".tiff");
+  if (tiled && (int64_t)width * (TIFF_TILE_SIZE + 2) > MAX_GRID_PIXELS) {
+    fprintf(stderr, "width can't be larger than %d\n", (int)(MAX_GRID_PIXELS / (TIFF_TILE_SIZE + 2)));
+    return 1;
+  }
+  if (!tiled && (int64_t)width * height > MAX_GRID_PIXELS) {
+    fprintf(stderr, "%dx%d has more than %lld pixels, use a .tif output to render it in bands\n", width, height, (long long)MAX_GRID_PIXELS);
+    return 1;
+  }
+  if (aa_samples < 1 || aa_samples > MAX_AA_SAMPLES || aa_depth < 0) {
+    fprintf(stderr, "aa must be between 1 and %d and aa-depth can't be negative\n", MAX_AA_SAMPLES);
+    return 1;
+  }
+  if (max_iter > MAX_ITER_LIMIT) {
+    fprintf(stderr, "max-iter can't be larger than %d\n", MAX_ITER_LIMIT);
+    return 1;
+  }
+
+  if (auto_precision) {
+    precision = select_precision(height, width, x_pos.hi, y_pos.hi, zoom, tolerance);
+  }
+  if (mode == SERIAL) {
+    precision = PRECISION_DOUBLE;
+  }
+  // Only the threaded grid kernels claim tiles in an order
+  probe = probe && mode == SIMD_THREADED && task_count > 1;
+
+  bool raw = ends_with(output, ".raw");
+  if (raw && mode == SIMD_FUSED) {
+    fprintf(stderr, "fused mode produces no depth/root planes, use a .ppm output\n");
+    return 1;
+  }
+  // The boundaries are found in the depth/root planes
+  if (aa_samples > 1 && (raw || mode == SIMD_FUSED)) {
+    fprintf(stderr, "aa needs a colored output and a mode with depth/root planes\n");
+    return 1;
+  }
+
+  if (!trace_path.empty()) {
+    trace_start();
+  }
+
+  if (tiled) {
+    Palette palette;
+    palette_update(palette, n, max_iter, k, min_brightness, 0);
+    string key = checkpoint_key(width, height, x_pos, y_pos, zoom, n, max_iter, tolerance, mode, precision, depth_tol, aa_samples, aa_depth, k, min_brightness);
+    int resumed_bands = 0;
+    long aa_pixels = 0;
+    double write_secs = 0.0;
+
+    auto render_before = steady_clock::now();
+    bool written = render_tiled(output, width, height, x_pos, y_pos, zoom, n, max_iter, tolerance, mode, precision, task_count, tile_size, probe, depth_tol,
+      aa_samples, aa_depth, palette, key, &resumed_bands, &aa_pixels, &write_secs);
+    auto render_duration = duration_cast<chrono::duration<double>>(steady_clock::now() - render_before);
+    if (!write_trace(trace_path)) {
+      return 1;
+    }
+    if (!written) {
+      fprintf(stderr, "Failed to write %s, rerun with the same options to continue from the last finished band\n", output.c_str());
+      return 1;
+    }
+
+    // compute_secs covers the bands rendered by this run including coloring, write_secs only the
+    // time spent waiting for the writer
+    double mpixels = (double)width * (height - min(height, resumed_bands * TIFF_TILE_SIZE)) / 1e6;
+    printf(
+      "{\"mode\":\"%s\",\"isa\":\"%s\",\"precision\":\"%s\",\"width\":%d,\"height\":%d,\"tasks\":%d,\"tile_size\":%d,\"schedule\":\"%s\",\"n\":%d,\"max_iter\":%d,"
+      "\"bands\":%d,\"resumed_bands\":%d,\"aa\":%d,\"aa_pixels\":%ld,\"compute_secs\":%.6f,\"write_secs\":%.6f,\"mpixels_per_sec\":%.3f,\"output\":\"%s\"}\n",
+      MODE_NAME[mode], target_name().c_str(), PRECISION_NAME[precision], width, height, mode == SIMD_THREADED || mode == SIMD_FUSED || mode == SIMD_SUBDIVIDE ? task_count : 1, tile_size, probe ? "probe" : "rows", n, max_iter,
+      (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE, resumed_bands, aa_samples, aa_pixels, render_duration.count(), write_secs, mpixels / render_duration.count(), json_escape(output).c_str());
+    return 0;
+  }
+
+  Grid grid = grid_alloc((size_t)width * height);
+  vector<Rgba> pixels;
+  Palette palette;
+  if (!raw) {
+    pixels.resize((size_t)width * height);
+    palette_update(palette, n, max_iter, k, min_brightness, 0);
+  }
+
+  // compute_secs includes the probe
+  auto compute_before = steady_clock::now();
+  if (mode == SIMD_FUSED) {
+    fractal_rgba(pixels.data(), height, width, x_pos, y_pos, tolerance, zoom, precision, palette, task_count, tile_size, Generation());
+  } else {
+    TileSchedule schedule;
+    if (probe) {
+      schedule_from_probe(schedule, precision, height, width, x_pos, y_pos, n, max_iter, tolerance, zoom, task_count, tile_size);
+    }
+    fractal(mode, precision, grid, height, width, x_pos, y_pos, n, max_iter, tolerance, zoom, task_count, tile_size, schedule_order(schedule, height, width, tile_size), depth_tol, Generation());
+  }
+  auto compute_duration = duration_cast<chrono::duration<double>>(steady_clock::now() - compute_before);
+
+  // Supersampling needs the colored image, it is timed on its own
+  long aa_pixels = 0;
+  auto aa_before = steady_clock::now();
+  if (aa_samples > 1) {
+    colorize(pixels.data(), grid, width * height, palette, task_count);
+    aa_pixels = antialias(pixels.data(), grid, height, width, x_pos, y_pos, tolerance, zoom, precision, palette, aa_samples, aa_depth, 0, height, 0, task_count, Generation());
+  }
+  auto aa_duration = duration_cast<chrono::duration<double>>(steady_clock::now() - aa_before);
+  if (!write_trace(trace_path)) {
+    grid_free(grid);
+    return 1;
+  }
+
+  // For the fused mode compute_secs already includes coloring
+  auto write_before = steady_clock::now();
+  bool written;
+  if (raw) {
+    written = write_raw(output, grid, width, height);
+  } else {
+    if (mode != SIMD_FUSED && aa_samples == 1) {
+      colorize(pixels.data(), grid, width * height, palette, task_count);
+    }
+    written = write_ppm(output, pixels.data(), width, height);
+  }
+  auto write_duration = duration_cast<chrono::duration<double>>(steady_clock::now() - write_before);
+
+  grid_free(grid);
+
+  if (!written) {
+    fprintf(stderr, "Failed to write %s\n", output.c_str());
+    return 1;
+  }
+
+  double mpixels = (double)width * height / 1e6;
+  printf(
+    "{\"mode\":\"%s\",\"isa\":\"%s\",\"precision\":\"%s\",\"width\":%d,\"height\":%d,\"tasks\":%d,\"tile_size\":%d,\"schedule\":\"%s\",\"n\":%d,\"max_iter\":%d,"
+    "\"aa\":%d,\"aa_pixels\":%ld,\"compute_secs\":%.6f,\"aa_secs\":%.6f,\"write_secs\":%.6f,\"mpixels_per_sec\":%.3f,\"output\":\"%s\"}\n",
+    MODE_NAME[mode], target_name().c_str(), PRECISION_NAME[precision], width, height, mode == SIMD_THREADED || mode == SIMD_FUSED || mode == SIMD_SUBDIVIDE ? task_count : 1, tile_size, probe ? "probe" : "rows", n, max_iter,
+    aa_samples, aa_pixels, compute_duration.count(), aa_duration.count(), write_duration.count(), mpixels / compute_duration.count(), json_escape(output).c_str());
+  return 0;
+}
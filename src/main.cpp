@@ -1,10 +1,21 @@
 #include "raylib.h"
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstdio>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <cstdlib>
 #include <chrono>
 #include "fractal.h"
+#include "color.h"
+#include "export.h"
+#include "video.h"
+#include "tile_cache.h"
+#include "tile_store.h"
+#include "schedule.h"
+#include "trace.h"
 
 using namespace std;
 using namespace chrono;
@@ -12,57 +23,416 @@ using namespace ispc;
 
 const int SCREEN_WIDTH = 1024;
 const int SCREEN_HEIGHT = 1024;
-const Color roots[] = { RED, GREEN, BLUE, YELLOW, ORANGE, PURPLE, GRAY, PINK, DARKGREEN, DARKBLUE};
+const string asset_path = "../output/";
+
+// Every recording goes into its own ../output/recording_<i> file. .gif and .y4m are written
+// directly, other video extensions are encoded by ffmpeg and .png writes numbered images instead
+const string RECORDING_EXTENSION = ".gif";
+const int RECORDING_FPS = 20;
+
+// Recorded frames are encoded on their own threads, which costs more than computing them.
+// When the encoders fall behind frames are dropped rather than stalling the window loop
+const int EXPORT_QUEUE_CAPACITY = 8;
+const ExportPolicy EXPORT_POLICY = EXPORT_DROP;
+
+bool export_png(const ExportFrame& frame, void* context) {
+    Image image = {
+      (void*)frame.pixels.data(),
+      frame.width,
+      frame.height,
+      1,
+      PIXELFORMAT_UNCOMPRESSED_R8G8B8A8
+    };
+    return ExportImage(image, frame.path.c_str());
+}
+
+bool export_video(const ExportFrame& frame, void* context) {
+    return video_write(*(VideoWriter*)context, frame.pixels.data());
+}
 
-enum Mode {
-  SERIAL,
-  SIMD,
-  SIMD_THREADED
+// PNGs are independent and get a pool of encoders, a stream has to be written in order by one
+bool start_recording(Exporter& exporter, VideoWriter& writer, int recording, int task_count) {
+    if (RECORDING_EXTENSION == ".png") {
+      exporter_start(exporter, export_png, nullptr, max(1, task_count / 4), EXPORT_QUEUE_CAPACITY, EXPORT_POLICY);
+      return true;
+    }
+    string path = asset_path + "recording_" + to_string(recording) + RECORDING_EXTENSION;
+    if (!video_open(writer, path, SCREEN_WIDTH, SCREEN_HEIGHT, RECORDING_FPS)) {
+      printf("Failed to open %s\n", path.c_str());
+      return false;
+    }
+    printf("Recording to %s\n", path.c_str());
+    exporter_start(exporter, export_video, &writer, 1, EXPORT_QUEUE_CAPACITY, EXPORT_POLICY);
+    return true;
+}
+
+// Waits for the queued frames to be written
+void stop_recording(Exporter& exporter, VideoWriter& writer) {
+    exporter_stop(exporter);
+    if (RECORDING_EXTENSION != ".png" && !video_close(writer)) {
+      printf("Failed to finish the recording\n");
+    }
+}
+
+// Every trace goes into its own ../output/trace_<i>.json file
+void stop_tracing(int trace) {
+    trace_stop();
+    string path = asset_path + "trace_" + to_string(trace) + ".json";
+    if (trace_write_json(path)) {
+      printf("Wrote the trace to %s\n", path.c_str());
+    } else {
+      printf("Failed to write %s\n", path.c_str());
+    }
+}
+
+// Memory for computed tiles, zooming back out or panning back to a spot already visited assembles
+// the frame from them instead of recomputing it. 0 disables the cache
+const size_t TILE_CACHE_BUDGET = (size_t)256 << 20;
+// Tiles are also saved to this file, so they survive a restart. The file is sparse, only what
+// has been written takes up disk space
+const string TILE_STORE_PATH = asset_path + "tiles.store";
+const size_t TILE_STORE_SIZE = (size_t)16 << 30;
+
+// Everything the render thread needs to produce a frame. While a request waits to be picked up
+// newer ones are merged into it, pans add up and changed and recolor stick until it's taken
+struct RenderRequest {
+    DoubleDouble x_pos = 0.0;
+    DoubleDouble y_pos = 0.0;
+    double zoom = 1.0;
+    int zoom_level = 0;
+    int n = 3;
+    int max_iter = 75;
+    double tolerance = DEFAULT_TOLERANCE;
+    Mode mode = SIMD_THREADED;
+    Palette palette;
+
+    int pan_x = 0;
+    int pan_y = 0;
+    bool changed = false;
+    bool recolor = false;
 };
 
-const char* MODE_STRING[] = {
-  "Serial",
-  "SIMD",
-  "SIMD Threaded"
+// Frames in flight, one being computed, one being colored and one being uploaded
+const int PIPELINE_DEPTH = 3;
+// Rows colored at a time, every finished band is uploaded on its own with UpdateTextureRec
+const int COLORIZE_BAND_ROWS = 64;
+
+enum SlotState {
+    SLOT_FREE,
+    SLOT_COMPUTED,
+    SLOT_COLORED
 };
 
-const string asset_path = "../output/";
+// One frame of the pipeline. Frame i always goes through slot i % PIPELINE_DEPTH, and a slot
+// only returns to SLOT_FREE once the UI uploaded all of it
+struct FrameSlot {
+    Grid grid;
+    vector<Rgba> pixels;
+    SlotState state = SLOT_FREE;
+
+    // Filled in by the compute stage. Coarse progressive passes aren't complete and aren't recorded
+    bool complete = false;
+    Mode mode = SIMD_THREADED;
+    Precision precision = PRECISION_DOUBLE;
+    Palette palette;
+
+    // Rows of pixels that are final, the UI uploads up to here while the rest is still being colored
+    atomic<int> rows_ready{0};
+};
+
+// Shared between the UI loop, the render thread and the colorize thread. The request and the
+// slot states are guarded by lock
+struct Renderer {
+    mutex lock;
+    condition_variable wake;
+    condition_variable slot_freed;
+    condition_variable frame_computed;
+    RenderRequest request;
+    bool pending = false;
+    bool quit = false;
+
+    // Bumped by the UI for every request that makes the frame in flight stale, the kernels
+    // compare it against the generation they were started for before claiming a tile
+    atomic<int32_t> generation{0};
+
+    FrameSlot slots[PIPELINE_DEPTH];
+};
+
+// Compute stage. Fills the grid of the next slot and hands it on to the colorize stage, frames that
+// went stale halfway through are dropped and the grid they left behind is recomputed from scratch.
+// Refining, panning and recoloring continue from the grid of the previous frame, which is copied
+// over first as that slot may still be colored or uploaded
+void render_loop(Renderer& renderer, int task_count) {
+    // The view the last published grid holds
+    RenderRequest view;
+    Precision precision = PRECISION_DOUBLE;
+    // Stride of the next progressive pass, 0 once the frame is complete
+    int pass_stride = 0;
+    double frame_secs = 0.0;
+    // Cleared when a frame was abandoned, a grid with holes can't be panned or refined
+    bool grid_valid = false;
+    trace_thread_name("render");
+    int32_t frame_generation = 0;
+    long frame_index = 0;
+    // Set when the view's frame is assembled from the tile cache once the coarsest pass is shown
+    bool use_cache = false;
+    int computed_tiles = 0;
+    // Progressive passes claim their tiles in the order the last published grid predicts, the
+    // previous frame for the coarsest pass and the previous pass for the later ones
+    TileSchedule schedule;
+    RenderRequest published;
+    TileCache cache;
+    cache.budget = TILE_CACHE_BUDGET;
+    TileStore store;
+    if (TILE_CACHE_BUDGET > 0 && tile_store_open(store, TILE_STORE_PATH, TILE_STORE_SIZE)) {
+      cache.store = &store;
+      printf("Tile store %s holds %llu tiles\n", TILE_STORE_PATH.c_str(), (unsigned long long)store.header->tile_count);
+    } else {
+      printf("Tile store %s could not be opened, tiles are only cached in memory\n", TILE_STORE_PATH.c_str());
+    }
+
+    while (true) {
+        bool taken = false;
+        RenderRequest request;
+        {
+            unique_lock<mutex> lock(renderer.lock);
+            // Unfinished progressive passes carry on without a new request
+            renderer.wake.wait(lock, [&] { return renderer.pending || renderer.quit || pass_stride > 0; });
+            if (renderer.quit) {
+                break;
+            }
+            if (renderer.pending) {
+                request = renderer.request;
+                renderer.request.pan_x = 0;
+                renderer.request.pan_y = 0;
+                renderer.request.changed = false;
+                renderer.request.recolor = false;
+                renderer.pending = false;
+                frame_generation = renderer.generation.load();
+                taken = true;
+            }
+        }
+        Generation generation = {&renderer.generation, frame_generation};
+
+        // The SIMD modes refine the frame one progressive pass at a time so a new request is picked
+        // up in between, anything that invalidates the grid starts over at the coarsest stride
+        bool changed = false;
+        bool recolor = false;
+        bool pan = false;
+        if (taken) {
+            changed = request.changed || !grid_valid;
+            recolor = request.recolor;
+            bool progressive = request.mode == SIMD || request.mode == SIMD_THREADED;
+
+            // A pan over a complete frame only computes the strips that scrolled into view, the rest
+            // of the grid is shifted. Anything else going on at the same time recomputes everything
+            if (request.pan_x != 0 || request.pan_y != 0) {
+                Precision pan_precision = select_precision(SCREEN_HEIGHT, SCREEN_WIDTH, request.x_pos.hi, request.y_pos.hi, request.zoom, request.tolerance);
+                if (!changed && progressive && pass_stride == 0 && pan_precision == precision && 
+                    abs(request.pan_x) < SCREEN_WIDTH && abs(request.pan_y) < SCREEN_HEIGHT) {
+                  pan = true;
+                } else {
+                  changed = true;
+                }
+            }
+
+            if (changed) {
+                precision = select_precision(SCREEN_HEIGHT, SCREEN_WIDTH, request.x_pos.hi, request.y_pos.hi, request.zoom, request.tolerance);
+                pass_stride = progressive ? PROGRESSIVE_STRIDE : 0;
+                frame_secs = 0.0;
+                // A view that is fully cached skips the progressive passes altogether
+                use_cache = false;
+                if (progressive && TILE_CACHE_BUDGET > 0) {
+                  int missing = tile_cache_missing(cache, SCREEN_HEIGHT, SCREEN_WIDTH, request.x_pos, request.y_pos, request.n, request.max_iter, request.tolerance, request.zoom, request.zoom_level, precision);
+                  use_cache = missing >= 0;
+                  if (missing == 0) {
+                    pass_stride = 0;
+                  }
+                }
+            }
+            view = request;
+        }
+        if (!changed && !recolor && !pan && pass_stride == 0) {
+            continue;
+        }
+
+        FrameSlot& slot = renderer.slots[frame_index % PIPELINE_DEPTH];
+        FrameSlot& previous = renderer.slots[(frame_index + PIPELINE_DEPTH - 1) % PIPELINE_DEPTH];
+        {
+            unique_lock<mutex> lock(renderer.lock);
+            renderer.slot_freed.wait(lock, [&] { return slot.state == SLOT_FREE || renderer.quit; });
+            if (renderer.quit) {
+                break;
+            }
+        }
+        // A new frame overwrites every pixel, everything else builds on the previous one
+        if (!changed && frame_index > 0) {
+            grid_copy(slot.grid, previous.grid, SCREEN_WIDTH * SCREEN_HEIGHT);
+        }
+
+        if (pan) {
+            auto pan_before = steady_clock::now();
+            fractal_pan(view.mode, precision, slot.grid, SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.n, view.max_iter, view.tolerance, view.zoom, request.pan_x, request.pan_y, task_count, DEFAULT_TILE_SIZE, generation);
+            auto duration = duration_cast<chrono::duration<double>>(steady_clock::now() - pan_before);
+            printf("Frame (%dx%d) panned by (%d, %d) pixels in %f secs\n", SCREEN_WIDTH, SCREEN_HEIGHT, request.pan_x, request.pan_y, duration.count());
+        } else if (changed || pass_stride > 0) {
+            auto compute_before = steady_clock::now();
+            
+            // With the cache only the coarsest pass is shown as a preview, the missing tiles are
+            // then computed at full resolution in one go
+            if (use_cache && pass_stride < PROGRESSIVE_STRIDE) {
+              computed_tiles = fractal_cached(cache, view.mode, precision, slot.grid, SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.n, view.max_iter, view.tolerance, view.zoom, view.zoom_level, task_count, DEFAULT_TILE_SIZE, generation);
+              pass_stride = 0;
+            } else if (pass_stride > 0) {
+              const int32_t* tile_order = nullptr;
+              if (view.mode == SIMD_THREADED && frame_index > 0) {
+                schedule_from_grid(schedule, previous.grid.depth, SCREEN_HEIGHT, SCREEN_WIDTH, published.x_pos, published.y_pos, published.zoom,
+                  SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.zoom, DEFAULT_TILE_SIZE);
+                tile_order = schedule_order(schedule, SCREEN_HEIGHT, SCREEN_WIDTH, DEFAULT_TILE_SIZE);
+              }
+              fractal_pass(view.mode, precision, slot.grid, SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.n, view.max_iter, view.tolerance, view.zoom, pass_stride, task_count, DEFAULT_TILE_SIZE, tile_order, generation);
+              pass_stride /= 2;
+            } else if (view.mode == SIMD_FUSED) {
+              fractal_rgba(slot.pixels.data(), SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.tolerance, view.zoom, precision, view.palette, task_count, DEFAULT_TILE_SIZE, generation);
+            } else {
+              fractal(view.mode, precision, slot.grid, SCREEN_HEIGHT, SCREEN_WIDTH, view.x_pos, view.y_pos, view.n, view.max_iter, view.tolerance, view.zoom, task_count, DEFAULT_TILE_SIZE, nullptr, 0, generation);
+            }
+            
+            frame_secs += duration_cast<chrono::duration<double>>(steady_clock::now() - compute_before).count();
+            
+            if (pass_stride == 0 && !generation.stale()) {
+              printf("Frame (%dx%d) recomputed in %f secs at (%.17g, %.17g) mode %s (%s) at %gx zoom with n=%d and max_iter=%d\n", SCREEN_WIDTH, SCREEN_HEIGHT, frame_secs, view.x_pos.hi, view.y_pos.hi, MODE_STRING[view.mode], view.mode == SERIAL ? "double" : PRECISION_NAME[precision], view.zoom, view.n, view.max_iter);
+              if (use_cache) {
+                printf("Tile cache: %d tiles computed, %ld loaded from disk so far, %zu of %zu MB used\n", computed_tiles, cache.loaded, cache.used >> 20, cache.budget >> 20);
+              }
+            }
+        }    
+
+        // A newer request is already waiting and will recompute, this frame is never shown
+        if (generation.stale()) {
+            grid_valid = false;
+            continue;
+        }
+        grid_valid = true;
+        published = view;
+
+        slot.complete = pass_stride == 0;
+        slot.mode = view.mode;
+        slot.precision = precision;
+        slot.palette = view.palette;
+        slot.rows_ready.store(0, memory_order_relaxed);
+        {
+            lock_guard<mutex> lock(renderer.lock);
+            slot.state = SLOT_COMPUTED;
+        }
+        renderer.frame_computed.notify_one();
+        frame_index++;
+    }
+    if (cache.store) {
+        tile_store_close(store);
+    }
+}
+
+// Colorize stage. Takes the computed frames in order and colors them band by band, so the UI can
+// start uploading the top of a frame while the bottom is still being colored
+void colorize_loop(Renderer& renderer, int task_count) {
+    long frame_index = 0;
+    trace_thread_name("colorize");
+
+    while (true) {
+        FrameSlot& slot = renderer.slots[frame_index % PIPELINE_DEPTH];
+        {
+            unique_lock<mutex> lock(renderer.lock);
+            renderer.frame_computed.wait(lock, [&] { return slot.state == SLOT_COMPUTED || renderer.quit; });
+            if (renderer.quit) {
+                break;
+            }
+        }
+
+        // The fused kernel already wrote the pixels
+        if (slot.mode == SIMD_FUSED) {
+            slot.rows_ready.store(SCREEN_HEIGHT, memory_order_release);
+        } else {
+            for (int y = 0; y < SCREEN_HEIGHT; y += COLORIZE_BAND_ROWS) {
+                int rows = min(COLORIZE_BAND_ROWS, SCREEN_HEIGHT - y);
+                Grid band = {slot.grid.depth + y * SCREEN_WIDTH, slot.grid.root + y * SCREEN_WIDTH};
+                colorize(slot.pixels.data() + y * SCREEN_WIDTH, band, rows * SCREEN_WIDTH, slot.palette, task_count);
+                slot.rows_ready.store(y + rows, memory_order_release);
+            }
+        }
+        {
+            lock_guard<mutex> lock(renderer.lock);
+            slot.state = SLOT_COLORED;
+        }
+        frame_index++;
+    }
+}
 
 int main() {
     // Fractal computation
     int n = 3;
-    int max_n = sizeof(roots) / sizeof(roots[0]);
+    int max_n = ROOT_COLOR_COUNT;
     int max_iter_step = 25;
     int max_iter = n * max_iter_step;
     double iter_delta_factor = 0.4;
     
-    double tolerance = 1e-7;
+    double tolerance = DEFAULT_TOLERANCE;
     
     // Positioning
-    double x_pos = 0.0f;
-    double y_pos = 0.0f;
+    // Double-double so panning keeps working once a step is below double epsilon of the position
+    DoubleDouble x_pos = 0.0;
+    DoubleDouble y_pos = 0.0;
+    // The zoom is always zoom_factor^zoom_level exactly, returning to a level gives the very same
+    // zoom so the cached tiles of that level are found again
+    int zoom_level = 0;
     double zoom = 1.0f;
     double zoom_factor = 1.2;
-    double base_step_size = 20.0f;
+    // Pans move by whole pixels so the grid can be shifted instead of recomputed
+    int pan_step = 20;
     
     // Color banding
     double k = 5.0f; 
     double min_brightness = 0.4f;
-    double log_base = 1 / logf(1.0f + k);
+    double k_factor = 1.05;
+    double brightness_step = 0.01;
+    int palette_rotation = 0;
+    Palette palette;
 
     // UI 
     bool changed = true;
     Mode mode = SIMD_THREADED;
+    Mode shown_mode = mode;
+    Precision shown_precision = PRECISION_DOUBLE;
     bool save = false;
      
-    // recording
-    int frame_idx = 0;
-
-    int threaded_jobs_count = 64;
+    int threaded_jobs_count = default_task_count();
     
-    vector<Color> pixels(SCREEN_WIDTH * SCREEN_HEIGHT);
-    Point* grid = (Point*) std::aligned_alloc(32,  SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(Point));
+    vector<Rgba> pixels(SCREEN_WIDTH * SCREEN_HEIGHT);
     
+    printf("ISPC kernels running on %s\n", target_name().c_str());
+
+    // Frames are computed and colored off the UI thread, input is handled at the full frame rate
+    // no matter how long a frame takes to compute
+    Renderer renderer;
+    for (FrameSlot& slot : renderer.slots) {
+      slot.grid = grid_alloc(SCREEN_WIDTH * SCREEN_HEIGHT);
+      slot.pixels.resize(SCREEN_WIDTH * SCREEN_HEIGHT);
+    }
+    thread render_thread(render_loop, ref(renderer), threaded_jobs_count);
+    thread colorize_thread(colorize_loop, ref(renderer), threaded_jobs_count);
+
+    // recording
+    Exporter exporter;
+    VideoWriter writer;
+    int recording = 0;
+    // tracing
+    bool tracing = false;
+    int traces = 0;
+    trace_thread_name("ui");
+    // The frame being uploaded and how many of its rows already are
+    long upload_index = 0;
+    int rows_uploaded = 0;
+
     InitWindow(SCREEN_WIDTH, SCREEN_HEIGHT, "Newton Fractal");
     SetTargetFPS(60);
 
@@ -75,30 +445,32 @@ int main() {
     });    
 
     while (!WindowShouldClose()) {
-        double step = base_step_size / zoom;
+        int pan_x = 0;
+        int pan_y = 0;
         if (IsKeyDown(KEY_A) || IsKeyDown(KEY_LEFT))  { 
-          x_pos -= step; 
-          changed = true; 
+          pan_x -= pan_step; 
         }
 
         if (IsKeyDown(KEY_D) || IsKeyDown(KEY_RIGHT)) { 
-          x_pos += step; 
-          changed = true; 
+          pan_x += pan_step; 
         }
 
         if (IsKeyDown(KEY_W) || IsKeyDown(KEY_UP))    { 
-          y_pos -= step; 
-          changed = true; 
+          pan_y -= pan_step; 
         }
 
         if (IsKeyDown(KEY_S) || IsKeyDown(KEY_DOWN))  { 
-          y_pos += step; 
-          changed = true; 
+          pan_y += pan_step; 
         }
+        // Before zooming, the pan is in pixels of the current zoom level
+        x_pos = x_pos + pan_x / zoom;
+        y_pos = y_pos + pan_y / zoom;
 
-        if (IsKeyDown(KEY_LEFT_SHIFT) && zoom > 1.0f)  { 
-          zoom /= zoom_factor; 
+        // Zooming out takes back exactly what zooming in to this level added to max_iter
+        if (IsKeyDown(KEY_LEFT_SHIFT) && zoom_level > 0)  { 
           int delta_max_iter = log(zoom) * iter_delta_factor;
+          zoom_level--;
+          zoom = pow(zoom_factor, zoom_level); 
           if (max_iter > delta_max_iter){
             max_iter -= delta_max_iter;
           }
@@ -106,24 +478,29 @@ int main() {
         }        
 
         if (IsKeyDown(KEY_SPACE))  { 
-          zoom *= zoom_factor; 
-          max_iter += log(zoom) * iter_delta_factor;
+          zoom_level++;
+          zoom = pow(zoom_factor, zoom_level); 
+          max_iter = min(max_iter + (int)(log(zoom) * iter_delta_factor), MAX_ITER_LIMIT);
           changed = true; 
         } 
 
+        // Keeps the center on a pixel of the zoom level, pans move by whole pixels and stay on it
+        x_pos = snap_to_pixel(x_pos, zoom);
+        y_pos = snap_to_pixel(y_pos, zoom);
+
         if (IsKeyPressed(KEY_EQUAL) && n < max_n)  { 
           n += 1; 
           max_iter = n * max_iter_step + log(zoom) * iter_delta_factor;
           changed = true; 
         }   
 
-        if (IsKeyPressed(KEY_MINUS) && n > 0)  { 
+        if (IsKeyPressed(KEY_MINUS) && n > 1)  { 
           n -= 1; 
           max_iter = n * max_iter_step + log(zoom) * iter_delta_factor;
           changed = true; 
         } 
 
-        if (IsKeyDown(KEY_Q))  { 
+        if (IsKeyDown(KEY_Q) && max_iter + 10 <= MAX_ITER_LIMIT)  { 
           max_iter += 10;
           changed = true; 
         }   
@@ -147,73 +524,154 @@ int main() {
           mode = SIMD_THREADED;
           changed = true; 
         }    
+
+        if (IsKeyPressed(KEY_FOUR) )  { 
+          mode = SIMD_FUSED;
+          changed = true; 
+        }    
+
+        if (IsKeyPressed(KEY_FIVE) )  { 
+          mode = SIMD_SUBDIVIDE;
+          changed = true; 
+        }    
+        // Palette keys only recolor the cached grid, they never trigger a recompute
+        if (IsKeyDown(KEY_RIGHT_BRACKET))  { 
+          k *= k_factor;
+        }
+
+        if (IsKeyDown(KEY_LEFT_BRACKET) && k > 0.1)  { 
+          k /= k_factor;
+        }
+
+        if (IsKeyDown(KEY_PERIOD))  { 
+          min_brightness = min(min_brightness + brightness_step, 1.0);
+        }
+
+        if (IsKeyDown(KEY_COMMA))  { 
+          min_brightness = max(min_brightness - brightness_step, 0.0);
+        }
+
+        if (IsKeyPressed(KEY_P))  { 
+          palette_rotation = (palette_rotation + 1) % max_n;
+        }
+
         if (IsKeyPressed(KEY_R) )  { 
-          save = !save; 
-          if (save){
-            printf("Started recording frames\n");
+          if (!save){
+            save = start_recording(exporter, writer, recording, threaded_jobs_count);
+            if (save) {
+              printf("Started recording frames\n");
+            }
           }else {
-            printf("Stoped recording frames\n");
+            save = false;
+            stop_recording(exporter, writer);
+            recording++;
+            printf("Stoped recording frames, %d recorded and %d dropped so far\n", exporter.accepted, exporter.dropped);
           }
         }    
 
-        if (changed) {
-            auto compute_before = steady_clock::now();
-            
-            switch (mode) {
-              case SERIAL:
-                fractal_cpp(grid, SCREEN_WIDTH, SCREEN_HEIGHT, x_pos, y_pos, n, max_iter, tolerance,zoom);
-                break;
-              case SIMD:
-                fractal_ispc(grid, SCREEN_WIDTH, SCREEN_HEIGHT, x_pos, y_pos, n, max_iter, tolerance,zoom, 1);
-                break;
-              case SIMD_THREADED:
-                fractal_ispc(grid, SCREEN_WIDTH, SCREEN_HEIGHT, x_pos, y_pos, n, max_iter, tolerance,zoom, threaded_jobs_count);
-                break;
-            }
+        if (IsKeyPressed(KEY_T))  { 
+          if (!tracing) {
+            trace_start();
+            tracing = true;
+            printf("Started tracing\n");
+          } else {
+            tracing = false;
+            stop_tracing(traces);
+            traces++;
+          }
+        }
 
-            
-            auto duration = duration_cast<chrono::duration<double>>(steady_clock::now() - compute_before);
-            
-            printf("Frame (%dx%d) recomputed in %f secs at (%.2f, %.2f) mode %s at %fx zoom with n=%d and max_iter=%d\n", SCREEN_WIDTH, SCREEN_HEIGHT,  duration.count(), x_pos, y_pos, MODE_STRING[mode], zoom,n, max_iter);
-            
-            if (save){
-              Image image = LoadImageFromTexture(texture); 
-              std::string path = std::format("{}frame_{:03}.png", asset_path, frame_idx);
-              printf("Exporting frame to %s\n", path.c_str());
-              ExportImage(image, path.c_str());
-              frame_idx++;
-            }
-        }    
-        
-        for (int y = 0; y < SCREEN_HEIGHT; y++) {
-            for (int x = 0; x < SCREEN_WIDTH; x++) {
-                int idx = y * SCREEN_WIDTH + x;
-            
-                Color color = roots[grid[idx].nearest_root % n];
-          
-                double normalized = static_cast<double>(grid[idx].depth) / max_iter;                
-                double brightness = logf(1.0f + k * normalized) * log_base;
+        bool recolor = palette_update(palette, n, max_iter, k, min_brightness, palette_rotation);
+        if (recolor && mode == SIMD_FUSED) {
+          // The fused kernel keeps no grid to recolor from
+          changed = true;
+        }
 
-                double brightness_adjusted = min_brightness + (1.0f - brightness) * brightness;
+        bool panned = pan_x != 0 || pan_y != 0;
+        if (changed || panned || recolor) {
+            lock_guard<mutex> lock(renderer.lock);
+            RenderRequest& request = renderer.request;
+            request.x_pos = x_pos;
+            request.y_pos = y_pos;
+            request.zoom = zoom;
+            request.zoom_level = zoom_level;
+            request.n = n;
+            request.max_iter = max_iter;
+            request.tolerance = tolerance;
+            request.mode = mode;
+            request.palette = palette;
+            request.pan_x += pan_x;
+            request.pan_y += pan_y;
+            request.changed |= changed;
+            request.recolor |= recolor;
+            renderer.pending = true;
+            // Only a new view makes the frame in flight stale, a new palette can still be applied to it
+            if (changed || panned) {
+              renderer.generation++;
+            }
+            renderer.wake.notify_one();
+        }
 
-                color.r *= brightness_adjusted; 
-                color.g *= brightness_adjusted; 
-                color.b *= brightness_adjusted; 
-                pixels[idx] = color;
+        // Uploads the bands of the oldest frame in flight that were colored since the last frame
+        FrameSlot& upload = renderer.slots[upload_index % PIPELINE_DEPTH];
+        SlotState upload_state;
+        {
+            lock_guard<mutex> lock(renderer.lock);
+            upload_state = upload.state;
+        }
+        if (upload_state != SLOT_FREE) {
+            int rows_ready = upload.rows_ready.load(memory_order_acquire);
+            if (rows_ready > rows_uploaded) {
+              Rectangle band = {0, (float)rows_uploaded, (float)SCREEN_WIDTH, (float)(rows_ready - rows_uploaded)};
+              UpdateTextureRec(texture, band, upload.pixels.data() + rows_uploaded * SCREEN_WIDTH);
+              rows_uploaded = rows_ready;
+              shown_mode = upload.mode;
+              shown_precision = upload.precision;
+            }
+            if (upload_state == SLOT_COLORED && rows_uploaded == SCREEN_HEIGHT) {
+              // The frame just uploaded, the texture itself is never read back
+              if (save && upload.complete) {
+                exporter_push(exporter, upload.pixels.data(), SCREEN_WIDTH, SCREEN_HEIGHT, asset_path + "frame_%03d.png");
+              }
+              {
+                lock_guard<mutex> lock(renderer.lock);
+                upload.state = SLOT_FREE;
+              }
+              renderer.slot_freed.notify_one();
+              upload_index++;
+              rows_uploaded = 0;
             }
         }
-      
-        UpdateTexture(texture, pixels.data());
         BeginDrawing();
         
         ClearBackground(BLACK);
         DrawTexture(texture, 0, 0, WHITE);
         DrawFPS(10,10);
+        DrawText(TextFormat("%s %s", MODE_STRING[shown_mode], shown_mode == SERIAL ? "double" : PRECISION_NAME[shown_precision]), 10, 35, 20, WHITE);
         
         EndDrawing();
         changed = false;
     }
-    std::free(grid);
+    {
+        lock_guard<mutex> lock(renderer.lock);
+        renderer.quit = true;
+        // Also cuts the frame in flight short
+        renderer.generation++;
+    }
+    renderer.wake.notify_all();
+    renderer.slot_freed.notify_all();
+    renderer.frame_computed.notify_all();
+    render_thread.join();
+    colorize_thread.join();
+    for (FrameSlot& slot : renderer.slots) {
+      grid_free(slot.grid);
+    }
+    if (save) {
+      stop_recording(exporter, writer);
+    }
+    if (tracing) {
+      stop_tracing(traces);
+    }
     UnloadTexture(texture);
     CloseWindow();
 }
@@ -0,0 +1,156 @@
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include "schedule.h"
+
+using namespace std;
+
+// Sums depth + 1 over every step-th pixel of every step-th row, a pixel that converged at once still
+// costs a step. The table covers the (height / step) x (width / step) samples, rounded up
+static void build_sums(TileSchedule& schedule, const uint16_t* depths, int height, int width, int step) {
+  int rows = (height + step - 1) / step;
+  int columns = (width + step - 1) / step;
+  int stride = columns + 1;
+  schedule.sums.assign((size_t)stride * (rows + 1), 0);
+  for (int row = 0; row < rows; row++) {
+    int64_t row_sum = 0;
+    const uint16_t* from = depths + (size_t)row * step * width;
+    const int64_t* above = schedule.sums.data() + (size_t)row * stride;
+    int64_t* sums = schedule.sums.data() + (size_t)(row + 1) * stride;
+    for (int column = 0; column < columns; column++) {
+      row_sum += from[column * step] + 1;
+      sums[column + 1] = above[column + 1] + row_sum;
+    }
+  }
+}
+
+static int64_t rect_sum(const TileSchedule& schedule, int columns, int x0, int y0, int x1, int y1) {
+  const int64_t* sums = schedule.sums.data();
+  size_t stride = columns + 1;
+  return sums[y1 * stride + x1] - sums[y0 * stride + x1] - sums[y1 * stride + x0] + sums[y0 * stride + x0];
+}
+
+// Costs and order from the sums build_sums left of the from_height x from_width grid
+static void schedule_tiles(
+    TileSchedule& schedule,
+    int from_height,
+    int from_width,
+    int step,
+    DoubleDouble from_x,
+    DoubleDouble from_y,
+    double from_zoom,
+    int screen_height,
+    int screen_width,
+    DoubleDouble x_pos,
+    DoubleDouble y_pos,
+    double zoom,
+    int tile_size
+  ){
+
+  int tiles_x = (screen_width + tile_size - 1) / tile_size;
+  int tiles_y = (screen_height + tile_size - 1) / tile_size;
+  schedule.screen_height = screen_height;
+  schedule.screen_width = screen_width;
+  schedule.tile_size = tile_size;
+  schedule.cost.resize(tiles_x * tiles_y);
+  schedule.order.resize(tiles_x * tiles_y);
+
+  int rows = (from_height + step - 1) / step;
+  int columns = (from_width + step - 1) / step;
+  double mean = (double)rect_sum(schedule, columns, 0, 0, columns, rows) / ((double)columns * rows);
+
+  // New pixel x lies at old pixel x * scale + offset_x, the same for y
+  double scale = from_zoom / zoom;
+  DoubleDouble shift_x = (x_pos - from_x) * from_zoom;
+  DoubleDouble shift_y = (y_pos - from_y) * from_zoom;
+  double offset_x = shift_x.hi + shift_x.lo + from_width * 0.5 - screen_width * 0.5 * scale;
+  double offset_y = shift_y.hi + shift_y.lo + from_height * 0.5 - screen_height * 0.5 * scale;
+
+  for (int ty = 0; ty < tiles_y; ty++) {
+    for (int tx = 0; tx < tiles_x; tx++) {
+      int x0 = tx * tile_size;
+      int y0 = ty * tile_size;
+      int x1 = min(x0 + tile_size, screen_width);
+      int y1 = min(y0 + tile_size, screen_height);
+      double old_x0 = x0 * scale + offset_x;
+      double old_y0 = y0 * scale + offset_y;
+      double old_x1 = x1 * scale + offset_x;
+      double old_y1 = y1 * scale + offset_y;
+
+      // Fraction of the tile the old view covers, the negated tests also catch NaNs of a far away view
+      double covered = 0.0;
+      double density = mean;
+      if (old_x1 > 0 && old_y1 > 0 && old_x0 < from_width && old_y0 < from_height) {
+        covered = (min(old_x1, (double)from_width) - max(old_x0, 0.0)) * (min(old_y1, (double)from_height) - max(old_y0, 0.0)) /
+          ((old_x1 - old_x0) * (old_y1 - old_y0));
+        // Widened to whole samples, a tile zoomed in from less than a sample still reads one
+        int sample_x0 = (int)max(floor(old_x0 / step), 0.0);
+        int sample_y0 = (int)max(floor(old_y0 / step), 0.0);
+        int sample_x1 = (int)min(ceil(old_x1 / step), (double)columns);
+        int sample_y1 = (int)min(ceil(old_y1 / step), (double)rows);
+        density = (double)rect_sum(schedule, columns, sample_x0, sample_y0, sample_x1, sample_y1) / ((double)(sample_x1 - sample_x0) * (sample_y1 - sample_y0));
+      }
+      schedule.cost[ty * tiles_x + tx] = (double)(x1 - x0) * (y1 - y0) * (covered * density + (1.0 - covered) * mean);
+    }
+  }
+
+  // Stable, tiles predicted alike stay row major
+  iota(schedule.order.begin(), schedule.order.end(), 0);
+  stable_sort(schedule.order.begin(), schedule.order.end(), [&](int32_t a, int32_t b) {
+    return schedule.cost[a] > schedule.cost[b];
+  });
+}
+
+void schedule_from_grid(
+    TileSchedule& schedule,
+    const uint16_t* depths,
+    int from_height,
+    int from_width,
+    DoubleDouble from_x,
+    DoubleDouble from_y,
+    double from_zoom,
+    int screen_height,
+    int screen_width,
+    DoubleDouble x_pos,
+    DoubleDouble y_pos,
+    double zoom,
+    int tile_size
+  ){
+
+  build_sums(schedule, depths, from_height, from_width, SCHEDULE_SAMPLE_STEP);
+  schedule_tiles(schedule, from_height, from_width, SCHEDULE_SAMPLE_STEP, from_x, from_y, from_zoom, screen_height, screen_width, x_pos, y_pos, zoom, tile_size);
+}
+
+void schedule_from_probe(
+    TileSchedule& schedule,
+    ispc::Precision precision,
+    int screen_height,
+    int screen_width,
+    DoubleDouble x_pos,
+    DoubleDouble y_pos,
+    int n,
+    int max_iter,
+    double tol,
+    double zoom,
+    int task_count,
+    int tile_size
+  ){
+
+  int probe_height = (screen_height + SCHEDULE_SAMPLE_STEP - 1) / SCHEDULE_SAMPLE_STEP;
+  int probe_width = (screen_width + SCHEDULE_SAMPLE_STEP - 1) / SCHEDULE_SAMPLE_STEP;
+  double probe_zoom = zoom / SCHEDULE_SAMPLE_STEP;
+  schedule.probe_depth.resize((size_t)probe_height * probe_width);
+  schedule.probe_root.resize((size_t)probe_height * probe_width);
+  Grid probe = {schedule.probe_depth.data(), schedule.probe_root.data()};
+
+  fractal(SIMD_THREADED, precision, probe, probe_height, probe_width, x_pos, y_pos, n, max_iter, tol, probe_zoom, task_count, tile_size, nullptr, 0, Generation());
+  build_sums(schedule, probe.depth, probe_height, probe_width, 1);
+  schedule_tiles(schedule, probe_height, probe_width, 1, x_pos, y_pos, probe_zoom, screen_height, screen_width, x_pos, y_pos, zoom, tile_size);
+}
+
+const int32_t* schedule_order(const TileSchedule& schedule, int screen_height, int screen_width, int tile_size) {
+  if (schedule.order.empty() || schedule.screen_height != screen_height || schedule.screen_width != screen_width || schedule.tile_size != tile_size) {
+    return nullptr;
+  }
+  return schedule.order.data();
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "fractal.h"
+
+// Cost ordered tile scheduling for the threaded kernels. They hand out their tiles dynamically, but in
+// row major order, so whichever task claims an expensive tile near the end of a frame keeps running
+// long after the others ran out of tiles. A pixel costs about its depth in Newton iterations, and a
+// frame looks much like the one before it, so the depths of an earlier frame predict the cost of every
+// tile. Claiming the tiles most expensive first leaves the cheap ones for the end, and the tasks finish
+// within about one cheap tile of each other with the same tasks and tiles as before
+
+// Costs are predicted from every SCHEDULE_SAMPLE_STEP-th pixel of every SCHEDULE_SAMPLE_STEP-th row,
+// 1/64 of the pixels and 16 per default tile. A probe computes just those
+const int SCHEDULE_SAMPLE_STEP = 8;
+
+struct TileSchedule {
+  int screen_height = 0;
+  int screen_width = 0;
+  int tile_size = 0;
+
+  // Row major tile indices in the order the tasks claim them
+  std::vector<int32_t> order;
+  // Predicted Newton iterations of every tile, row major
+  std::vector<double> cost;
+
+  // Summed-area table of the sampled depths the costs are predicted from, sums any rectangle of
+  // them with four lookups. Reused between frames like the probe grid
+  std::vector<int64_t> sums;
+  std::vector<uint16_t> probe_depth;
+  std::vector<uint8_t> probe_root;
+};
+
+// Predicts the tiles of the view at (x_pos, y_pos) and zoom from depths, a from_height x from_width grid
+// computed at (from_x, from_y) and from_zoom. The views may differ in position, zoom and resolution,
+// every tile takes the depths of the part of the old view it covers. Tiles outside of it get the mean
+void schedule_from_grid(
+  TileSchedule& schedule,
+  const uint16_t* depths,
+  int from_height,
+  int from_width,
+  DoubleDouble from_x,
+  DoubleDouble from_y,
+  double from_zoom,
+  int screen_height,
+  int screen_width,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  double zoom,
+  int tile_size
+);
+
+// For a view without an earlier frame, predicts its tiles from a probe, the same view computed at
+// 1 / SCHEDULE_SAMPLE_STEP of its resolution with the SIMD_THREADED kernel
+void schedule_from_probe(
+  TileSchedule& schedule,
+  ispc::Precision precision,
+  int screen_height,
+  int screen_width,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  int n,
+  int max_iter,
+  double tol,
+  double zoom,
+  int task_count,
+  int tile_size
+);
+
+// tile_order to pass to the kernels. NULL, row major, unless the schedule was built for this view
+// size and tile size
+const int32_t* schedule_order(const TileSchedule& schedule, int screen_height, int screen_width, int tile_size);
@@ -0,0 +1,164 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "taskbench_ispc.h"
+
+using namespace std;
+using namespace chrono;
+using namespace ispc;
+
+// Built once per task system, see TASK_SYSTEM in CMakeLists.txt
+#ifndef TASK_SYSTEM_NAME
+#define TASK_SYSTEM_NAME "unknown"
+#endif
+
+void usage(const char* program) {
+  fprintf(stderr,
+    "Usage: %s [options]\n"
+    "  --tasks <list>        task counts per launch (default 1,4,16,64,256,1024,4096)\n"
+    "  --repeats <int>       timed launches of empty tasks per count (default 2000)\n"
+    "  --work-repeats <int>  timed launches of busy tasks per count (default 20)\n"
+    "  --work <int>          multiply-add iterations per launch, split over the tasks (default 16777216)\n"
+    "  --skew <int>          every skew-th busy task is 8x as expensive, 0 for none (default 8)\n"
+    "  --output <path>       write the JSON report here instead of stdout\n",
+    program);
+}
+
+vector<int> parse_ints(const char* list) {
+  vector<int> values;
+  string item;
+  for (const char* c = list; ; c++) {
+    if (*c == ',' || *c == '\0') {
+      if (!item.empty()) {
+        values.push_back(atoi(item.c_str()));
+      }
+      item.clear();
+      if (*c == '\0') {
+        break;
+      }
+    } else {
+      item += *c;
+    }
+  }
+  return values;
+}
+
+// Nearest rank percentile of sorted samples
+double percentile(const vector<double>& sorted, double p) {
+  int rank = (int)(p * sorted.size() + 0.999999) - 1;
+  return sorted[clamp(rank, 0, (int)sorted.size() - 1)];
+}
+
+template <typename F>
+vector<double> time_runs(int repeats, F run) {
+  vector<double> seconds(repeats);
+  for (int i = 0; i < repeats; i++) {
+    auto before = steady_clock::now();
+    run();
+    seconds[i] = duration_cast<chrono::duration<double>>(steady_clock::now() - before).count();
+  }
+  sort(seconds.begin(), seconds.end());
+  return seconds;
+}
+
+int main(int argc, char** argv) {
+  vector<int> task_counts = {1, 4, 16, 64, 256, 1024, 4096};
+  int repeats = 2000;
+  int work_repeats = 20;
+  int work = 1 << 24;
+  int skew = 8;
+  const char* output = nullptr;
+
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    if (strcmp(arg, "--help") == 0 || strcmp(arg, "-h") == 0) {
+      usage(argv[0]);
+      return 0;
+    }
+    if (i + 1 >= argc) {
+      fprintf(stderr, "Missing value for %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+    const char* value = argv[++i];
+
+    if (strcmp(arg, "--tasks") == 0) {
+      task_counts = parse_ints(value);
+    } else if (strcmp(arg, "--repeats") == 0) {
+      repeats = atoi(value);
+    } else if (strcmp(arg, "--work-repeats") == 0) {
+      work_repeats = atoi(value);
+    } else if (strcmp(arg, "--work") == 0) {
+      work = atoi(value);
+    } else if (strcmp(arg, "--skew") == 0) {
+      skew = atoi(value);
+    } else if (strcmp(arg, "--output") == 0) {
+      output = value;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", arg);
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (repeats <= 0 || work_repeats <= 0 || work <= 0 || skew < 0) {
+    fprintf(stderr, "repeats, work-repeats and work must be positive\n");
+    return 1;
+  }
+  for (int task_count : task_counts) {
+    if (task_count <= 0) {
+      fprintf(stderr, "tasks must be positive\n");
+      return 1;
+    }
+  }
+
+  FILE* out = output ? fopen(output, "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "Failed to open %s\n", output);
+    return 1;
+  }
+
+  int max_tasks = *max_element(task_counts.begin(), task_counts.end());
+  vector<float> results(max_tasks);
+
+  // Starts the worker threads, their creation shouldn't count towards the first launch
+  empty_tasks(1);
+
+  // Reference for the speedups, the same work in a single task
+  double single_secs = percentile(time_runs(work_repeats, [&] { busy_tasks(1, work, 0, results.data()); }), 0.50);
+
+  fprintf(out, "{\n  \"task_system\": \"%s\",\n  \"hardware_threads\": %u,\n  \"work\": %d,\n  \"skew\": %d,\n  \"single_task_secs\": %.6f,\n  \"results\": [\n",
+    TASK_SYSTEM_NAME, thread::hardware_concurrency(), work, skew, single_secs);
+
+  for (size_t t = 0; t < task_counts.size(); t++) {
+    int task_count = task_counts[t];
+    int iterations = max(1, work / task_count);
+
+    // Launch plus sync of tasks that do nothing, the pure scheduling overhead
+    vector<double> empty = time_runs(repeats, [&] { empty_tasks(task_count); });
+    vector<double> uniform = time_runs(work_repeats, [&] { busy_tasks(task_count, iterations, 0, results.data()); });
+    vector<double> skewed = time_runs(work_repeats, [&] { busy_tasks(task_count, iterations, skew, results.data()); });
+
+    fprintf(out,
+      "    {\"tasks\": %d, \"launch_p50_us\": %.3f, \"launch_p99_us\": %.3f, \"launch_per_task_ns\": %.1f, "
+      "\"uniform_p50_secs\": %.6f, \"uniform_speedup\": %.2f, \"skewed_p50_secs\": %.6f}%s\n",
+      task_count, percentile(empty, 0.50) * 1e6, percentile(empty, 0.99) * 1e6, percentile(empty, 0.50) * 1e9 / task_count,
+      percentile(uniform, 0.50), single_secs / percentile(uniform, 0.50), percentile(skewed, 0.50),
+      t + 1 < task_counts.size() ? "," : "");
+    fflush(out);
+
+    fprintf(stderr, "[%zu/%zu] %s tasks=%d: launch p50 %.2f us, uniform p50 %.2f ms\n",
+      t + 1, task_counts.size(), TASK_SYSTEM_NAME, task_count, percentile(empty, 0.50) * 1e6, percentile(uniform, 0.50) * 1e3);
+  }
+
+  fprintf(out, "  ]\n}\n");
+  if (output) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,472 @@
+// Work-stealing implementation of the ispc task entry points, a replacement for the pthreads
+// backend of include/tasksys.cpp which pops every task under one global mutex and posts a
+// semaphore per task.
+//
+// Every thread that launches or runs tasks owns a Chase-Lev deque. A launch pushes a single job
+// covering all of its task indices, whoever runs a job splits off the upper half of the range
+// and pushes it back before running the first index, so the tasks fan out over the thieves in
+// log(count) steps. Idle workers spin over the deques for a while before parking on a futex,
+// ISPCSync helps out with queued jobs and parks on the group's unfinished counter once there is
+// nothing left to take.
+//
+// With tracing on every task, every sync and the time workers spend without work are recorded,
+// see trace.h.
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <vector>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include "trace.h"
+
+using namespace std;
+
+// Signature of ispc generated task functions
+typedef void (*TaskFunc)(void* data, int thread_index, int thread_count, int task_index, int task_count,
+                         int task_index0, int task_index1, int task_index2, int task_count0, int task_count1, int task_count2);
+
+extern "C" {
+void ISPCLaunch(void** handle_ptr, void* func, void* data, int count0, int count1, int count2);
+void* ISPCAlloc(void** handle_ptr, int64_t size, int32_t alignment);
+void ISPCSync(void* handle);
+}
+
+// Workers plus every outside thread that ever launched, each gets a deque slot for life
+const int MAX_THREADS = 256;
+// Failed steal rounds before an idle worker parks, a round visits every deque once
+const int SPIN_ROUNDS = 64;
+const int INITIAL_DEQUE_CAPACITY = 256;
+const size_t FIRST_ARENA_BLOCK = 4096;
+
+static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_pause();
+#else
+  this_thread::yield();
+#endif
+}
+
+// Sleeps while word still holds expected. Spurious returns are fine, every caller rechecks
+static void park(atomic<uint32_t>& word, uint32_t expected) {
+#if defined(__linux__)
+  syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+#else
+  word.wait(expected);
+#endif
+}
+
+static void unpark(atomic<uint32_t>& word, int count) {
+#if defined(__linux__)
+  syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE_PRIVATE, count, nullptr, nullptr, 0);
+#else
+  if (count == 1) {
+    word.notify_one();
+  } else {
+    word.notify_all();
+  }
+#endif
+}
+
+struct TaskGroup;
+
+// One ISPCLaunch call, lives in the arena of its group until the group is synced
+struct Launch {
+  TaskFunc func;
+  void* data;
+  int count[3];
+  TaskGroup* group;
+};
+
+// Bump allocator behind ISPCAlloc, blocks are kept when the group is recycled
+struct Arena {
+  struct Block {
+    char* memory;
+    size_t size;
+  };
+  vector<Block> blocks;
+  size_t current = 0;
+  size_t offset = 0;
+
+  void* alloc(size_t size, size_t alignment) {
+    while (true) {
+      if (current < blocks.size()) {
+        Block& block = blocks[current];
+        uintptr_t start = ((uintptr_t)block.memory + offset + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        if (start + size <= (uintptr_t)block.memory + block.size) {
+          offset = start + size - (uintptr_t)block.memory;
+          return (void*)start;
+        }
+        current++;
+        offset = 0;
+        continue;
+      }
+      size_t block_size = max(size + alignment, FIRST_ARENA_BLOCK << min(blocks.size(), (size_t)16));
+      char* memory = (char*)malloc(block_size);
+      if (!memory) {
+        fprintf(stderr, "Out of memory allocating %zu bytes of task arguments\n", block_size);
+        exit(1);
+      }
+      blocks.push_back({memory, block_size});
+    }
+  }
+
+  void reset() {
+    current = 0;
+    offset = 0;
+  }
+};
+
+// Everything launched from one invocation of an ispc function, ISPCSync waits for all of it.
+// Groups are recycled per thread and never freed, so a finishing task may still touch one
+// after its owner returned from the sync without that memory going away
+struct TaskGroup {
+  // Tasks launched but not finished yet, also the futex word the syncing thread parks on
+  atomic<uint32_t> unfinished{0};
+  atomic<bool> waiting{false};
+  Arena arena;
+};
+
+// Range of task indices [begin, end) of one launch. Stored field by field with relaxed atomics,
+// a thief may read a slot the owner is overwriting but then always loses the CAS on top
+struct Job {
+  Launch* launch;
+  int begin;
+  int end;
+};
+
+struct Slot {
+  atomic<Launch*> launch;
+  atomic<int> begin;
+  atomic<int> end;
+};
+
+struct SlotArray {
+  int64_t capacity;
+  Slot* slots;
+
+  explicit SlotArray(int64_t capacity) : capacity(capacity), slots(new Slot[capacity]) {}
+
+  void put(int64_t index, const Job& job) {
+    Slot& slot = slots[index & (capacity - 1)];
+    slot.launch.store(job.launch, memory_order_relaxed);
+    slot.begin.store(job.begin, memory_order_relaxed);
+    slot.end.store(job.end, memory_order_relaxed);
+  }
+
+  Job get(int64_t index) const {
+    const Slot& slot = slots[index & (capacity - 1)];
+    return {slot.launch.load(memory_order_relaxed), slot.begin.load(memory_order_relaxed), slot.end.load(memory_order_relaxed)};
+  }
+};
+
+// Chase-Lev deque as formulated for C11 atomics by Le, Pop, Cohen and Zappa Nardelli.
+// Only the owner pushes and pops at the bottom, any thread steals from the top
+struct Deque {
+  alignas(64) atomic<int64_t> top{0};
+  alignas(64) atomic<int64_t> bottom{0};
+  atomic<SlotArray*> array;
+  // Arrays replaced by a grow, a thief may still be reading them
+  vector<SlotArray*> retired;
+
+  Deque() : array(new SlotArray(INITIAL_DEQUE_CAPACITY)) {}
+
+  void push(const Job& job) {
+    int64_t b = bottom.load(memory_order_relaxed);
+    int64_t t = top.load(memory_order_acquire);
+    SlotArray* a = array.load(memory_order_relaxed);
+    if (b - t > a->capacity - 1) {
+      SlotArray* grown = new SlotArray(a->capacity * 2);
+      for (int64_t i = t; i < b; i++) {
+        grown->put(i, a->get(i));
+      }
+      retired.push_back(a);
+      array.store(grown, memory_order_release);
+      a = grown;
+    }
+    a->put(b, job);
+    bottom.store(b + 1, memory_order_release);
+  }
+
+  bool pop(Job& job) {
+    int64_t b = bottom.load(memory_order_relaxed) - 1;
+    SlotArray* a = array.load(memory_order_relaxed);
+    bottom.store(b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = top.load(memory_order_relaxed);
+
+    if (t > b) {
+      bottom.store(b + 1, memory_order_relaxed);
+      return false;
+    }
+    job = a->get(b);
+    if (t == b) {
+      // Last job, race the thieves for it
+      bool won = top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+      bottom.store(b + 1, memory_order_relaxed);
+      return won;
+    }
+    return true;
+  }
+
+  bool steal(Job& job) {
+    int64_t t = top.load(memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = bottom.load(memory_order_acquire);
+    if (t >= b) {
+      return false;
+    }
+    SlotArray* a = array.load(memory_order_consume);
+    job = a->get(t);
+    return top.compare_exchange_strong(t, t + 1, memory_order_seq_cst, memory_order_relaxed);
+  }
+
+  bool empty() const {
+    return top.load(memory_order_acquire) >= bottom.load(memory_order_acquire);
+  }
+};
+
+struct ThreadState {
+  int index;
+  Deque deque;
+  uint32_t random_state;
+  vector<TaskGroup*> free_groups;
+};
+
+struct Scheduler {
+  atomic<ThreadState*> threads[MAX_THREADS];
+  atomic<int> thread_count{0};
+  int worker_count = 0;
+
+  // Bumped whenever work is pushed while someone sleeps, the futex word of idle workers
+  atomic<uint32_t> work_epoch{0};
+  atomic<int> sleeping{0};
+};
+
+static Scheduler scheduler;
+static once_flag scheduler_started;
+static thread_local ThreadState* self = nullptr;
+
+static ThreadState* register_thread() {
+  int index = scheduler.thread_count.fetch_add(1);
+  if (index >= MAX_THREADS) {
+    fprintf(stderr, "More than %d threads launched ispc tasks, raise MAX_THREADS\n", MAX_THREADS);
+    exit(1);
+  }
+  ThreadState* state = new ThreadState;
+  state->index = index;
+  state->random_state = 2654435761u * (index + 1);
+  scheduler.threads[index].store(state, memory_order_release);
+  return state;
+}
+
+static ThreadState* current_thread() {
+  if (!self) {
+    self = register_thread();
+  }
+  return self;
+}
+
+// Wakes one parked worker if there is any. The fence pairs with the one in worker_loop: either
+// the worker sees the pushed job while rechecking, or we see it counted as sleeping
+static void notify_work() {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (scheduler.sleeping.load(memory_order_relaxed) > 0) {
+    scheduler.work_epoch.fetch_add(1, memory_order_relaxed);
+    unpark(scheduler.work_epoch, 1);
+  }
+}
+
+static bool steal_any(ThreadState* state, Job& job) {
+  int count = scheduler.thread_count.load(memory_order_acquire);
+  // xorshift, starting at a random victim keeps the thieves from piling onto the same deque
+  state->random_state ^= state->random_state << 13;
+  state->random_state ^= state->random_state >> 17;
+  state->random_state ^= state->random_state << 5;
+  int start = state->random_state % count;
+
+  for (int i = 0; i < count; i++) {
+    int victim = (start + i) % count;
+    ThreadState* other = scheduler.threads[victim].load(memory_order_acquire);
+    if (!other || other == state) {
+      continue;
+    }
+    if (other->deque.steal(job)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool any_work() {
+  int count = scheduler.thread_count.load(memory_order_acquire);
+  for (int i = 0; i < count; i++) {
+    ThreadState* other = scheduler.threads[i].load(memory_order_acquire);
+    if (other && !other->deque.empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Splits the job down to a single task, pushing the upper halves for thieves, then runs that task
+static void run_job(ThreadState* state, Job job) {
+  while (job.end - job.begin > 1) {
+    int middle = job.begin + (job.end - job.begin) / 2;
+    state->deque.push({job.launch, middle, job.end});
+    notify_work();
+    job.end = middle;
+  }
+
+  Launch* launch = job.launch;
+  int count0 = launch->count[0];
+  int count1 = launch->count[1];
+  int index = job.begin;
+  int count = count0 * count1 * launch->count[2];
+  uint64_t traced = trace_task_begin();
+  launch->func(launch->data, state->index, MAX_THREADS, index, count,
+               index % count0, (index / count0) % count1, index / (count0 * count1),
+               count0, count1, launch->count[2]);
+  trace_task_end(traced, (const void*)launch->func, index, count);
+
+  TaskGroup* group = launch->group;
+  if (group->unfinished.fetch_sub(1, memory_order_acq_rel) == 1 && group->waiting.load()) {
+    unpark(group->unfinished, INT_MAX);
+  }
+}
+
+static bool run_one(ThreadState* state) {
+  Job job;
+  if (state->deque.pop(job) || steal_any(state, job)) {
+    run_job(state, job);
+    return true;
+  }
+  return false;
+}
+
+static void worker_loop(ThreadState* state) {
+  self = state;
+  char name[32];
+  snprintf(name, sizeof(name), "worker %d", state->index);
+  trace_thread_name(name);
+
+  int idle_rounds = 0;
+  while (true) {
+    if (run_one(state)) {
+      idle_rounds = 0;
+      continue;
+    }
+    trace_idle();
+    if (++idle_rounds < SPIN_ROUNDS) {
+      cpu_relax();
+      continue;
+    }
+
+    uint32_t epoch = scheduler.work_epoch.load(memory_order_relaxed);
+    scheduler.sleeping.fetch_add(1, memory_order_seq_cst);
+    // Pairs with the fence in notify_work, the deque loads in any_work can't move above the count
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!any_work()) {
+      park(scheduler.work_epoch, epoch);
+    }
+    scheduler.sleeping.fetch_sub(1, memory_order_relaxed);
+    idle_rounds = 0;
+  }
+}
+
+// One worker less than hardware threads, the thread calling ISPCSync works along
+static void start_workers() {
+  scheduler.worker_count = max(1u, thread::hardware_concurrency()) - 1;
+  for (int i = 0; i < scheduler.worker_count; i++) {
+    ThreadState* state = register_thread();
+    thread(worker_loop, state).detach();
+  }
+}
+
+static TaskGroup* group_alloc() {
+  call_once(scheduler_started, start_workers);
+  ThreadState* state = current_thread();
+  if (state->free_groups.empty()) {
+    return new TaskGroup;
+  }
+  TaskGroup* group = state->free_groups.back();
+  state->free_groups.pop_back();
+  return group;
+}
+
+void* ISPCAlloc(void** handle_ptr, int64_t size, int32_t alignment) {
+  if (!*handle_ptr) {
+    *handle_ptr = group_alloc();
+  }
+  TaskGroup* group = (TaskGroup*)*handle_ptr;
+  return group->arena.alloc(size, alignment);
+}
+
+void ISPCLaunch(void** handle_ptr, void* func, void* data, int count0, int count1, int count2) {
+  if (!*handle_ptr) {
+    *handle_ptr = group_alloc();
+  }
+  TaskGroup* group = (TaskGroup*)*handle_ptr;
+  int count = count0 * count1 * count2;
+  if (count <= 0) {
+    return;
+  }
+
+  Launch* launch = (Launch*)group->arena.alloc(sizeof(Launch), alignof(Launch));
+  *launch = {(TaskFunc)func, data, {count0, count1, count2}, group};
+  group->unfinished.fetch_add(count, memory_order_relaxed);
+
+  current_thread()->deque.push({launch, 0, count});
+  notify_work();
+}
+
+void ISPCSync(void* handle) {
+  TaskGroup* group = (TaskGroup*)handle;
+  if (!group) {
+    return;
+  }
+  ThreadState* state = current_thread();
+  uint64_t traced = trace_sync_begin();
+
+  int idle_rounds = 0;
+  while (true) {
+    uint32_t unfinished = group->unfinished.load(memory_order_acquire);
+    if (unfinished == 0) {
+      break;
+    }
+    // Running other groups' jobs here is fine, they can't depend on this one finishing
+    if (run_one(state)) {
+      idle_rounds = 0;
+      continue;
+    }
+    trace_idle();
+    if (++idle_rounds < SPIN_ROUNDS) {
+      cpu_relax();
+      continue;
+    }
+
+    // Everything left is already running on other threads
+    group->waiting.store(true);
+    unfinished = group->unfinished.load();
+    if (unfinished != 0) {
+      park(group->unfinished, unfinished);
+    }
+    idle_rounds = 0;
+  }
+
+  group->waiting.store(false, memory_order_relaxed);
+  group->arena.reset();
+  state->free_groups.push_back(group);
+  trace_sync_end(traced);
+}
@@ -0,0 +1,184 @@
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tiff.h"
+
+using namespace std;
+
+const size_t TIFF_TILE_BYTES = (size_t)TIFF_TILE_SIZE * TIFF_TILE_SIZE * 3;
+
+// Field types of the BigTIFF IFD entries
+const uint16_t TIFF_SHORT = 3;
+const uint16_t TIFF_LONG = 4;
+const uint16_t TIFF_LONG8 = 16;
+
+const int TIFF_HEADER_BYTES = 16;
+const int TIFF_ENTRY_COUNT = 11;
+const int TIFF_IFD_BYTES = 8 + TIFF_ENTRY_COUNT * 20 + 8;
+
+static uint64_t tables_offset() {
+  return (TIFF_HEADER_BYTES + TIFF_IFD_BYTES + 15) & ~(uint64_t)15;
+}
+
+static uint64_t file_size(const TiffWriter& writer) {
+  return writer.data_offset + (uint64_t)writer.tiles_across * writer.tiles_down * TIFF_TILE_BYTES;
+}
+
+static bool write_all(int file, const void* data, size_t size, uint64_t offset) {
+  const uint8_t* bytes = (const uint8_t*)data;
+  while (size > 0) {
+    ssize_t written = pwrite(file, bytes, size, offset);
+    if (written <= 0) {
+      return false;
+    }
+    bytes += written;
+    size -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Entries have to be added in ascending tag order
+struct IfdBuilder {
+  vector<uint8_t> bytes;
+
+  void put(const void* data, size_t size) {
+    bytes.insert(bytes.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+  }
+
+  // Values of up to 8 bytes are stored in the entry itself, otherwise value is their offset
+  void entry(uint16_t tag, uint16_t type, uint64_t count, uint64_t value) {
+    put(&tag, sizeof(tag));
+    put(&type, sizeof(type));
+    put(&count, sizeof(count));
+    put(&value, sizeof(value));
+  }
+};
+
+static uint64_t counts_offset(const TiffWriter& writer) {
+  return tables_offset() + (uint64_t)writer.tiles_across * writer.tiles_down * sizeof(uint64_t);
+}
+
+// The 16 byte header followed by the IFD, everything that describes the layout of the file
+static vector<uint8_t> header_bytes(const TiffWriter& writer) {
+  uint64_t tile_count = (uint64_t)writer.tiles_across * writer.tiles_down;
+  uint64_t offsets_offset = tables_offset();
+
+  IfdBuilder ifd;
+  const uint8_t header[8] = {'I', 'I', 43, 0, 8, 0, 0, 0};
+  ifd.put(header, sizeof(header));
+  uint64_t ifd_offset = TIFF_HEADER_BYTES;
+  ifd.put(&ifd_offset, sizeof(ifd_offset));
+
+  uint64_t entry_count = TIFF_ENTRY_COUNT;
+  ifd.put(&entry_count, sizeof(entry_count));
+  ifd.entry(256, TIFF_LONG, 1, writer.width);
+  ifd.entry(257, TIFF_LONG, 1, writer.height);
+  // Three 8 bit samples packed into the value field
+  ifd.entry(258, TIFF_SHORT, 3, 8 | (8ull << 16) | (8ull << 32));
+  ifd.entry(259, TIFF_SHORT, 1, 1);
+  ifd.entry(262, TIFF_SHORT, 1, 2);
+  ifd.entry(277, TIFF_SHORT, 1, 3);
+  ifd.entry(284, TIFF_SHORT, 1, 1);
+  ifd.entry(322, TIFF_LONG, 1, TIFF_TILE_SIZE);
+  ifd.entry(323, TIFF_LONG, 1, TIFF_TILE_SIZE);
+  ifd.entry(324, TIFF_LONG8, tile_count, tile_count == 1 ? writer.data_offset : offsets_offset);
+  ifd.entry(325, TIFF_LONG8, tile_count, tile_count == 1 ? TIFF_TILE_BYTES : counts_offset(writer));
+  uint64_t next_ifd = 0;
+  ifd.put(&next_ifd, sizeof(next_ifd));
+  return ifd.bytes;
+}
+
+static bool write_header(TiffWriter& writer) {
+  uint64_t tile_count = (uint64_t)writer.tiles_across * writer.tiles_down;
+  uint64_t offsets_offset = tables_offset();
+  vector<uint8_t> header = header_bytes(writer);
+  if (!write_all(writer.file, header.data(), header.size(), 0)) {
+    return false;
+  }
+
+  // Tiles are stored in row major tile order
+  vector<uint64_t> table(tile_count);
+  for (uint64_t i = 0; i < tile_count; i++) {
+    table[i] = writer.data_offset + i * TIFF_TILE_BYTES;
+  }
+  if (!write_all(writer.file, table.data(), table.size() * sizeof(uint64_t), offsets_offset)) {
+    return false;
+  }
+  fill(table.begin(), table.end(), TIFF_TILE_BYTES);
+  return write_all(writer.file, table.data(), table.size() * sizeof(uint64_t), counts_offset(writer));
+}
+
+// A file of the right size can still have another width, height or tile size, e.g. 512x256 against
+// 256x512. Its header and IFD have to match the ones this image would get byte for byte
+static bool header_matches(const TiffWriter& writer) {
+  vector<uint8_t> expected = header_bytes(writer);
+  vector<uint8_t> existing(expected.size());
+  return pread(writer.file, existing.data(), existing.size(), 0) == (ssize_t)existing.size() && existing == expected;
+}
+
+bool tiff_open(TiffWriter& writer, const string& path, int width, int height, bool resume) {
+  writer.width = width;
+  writer.height = height;
+  writer.tiles_across = (width + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+  writer.tiles_down = (height + TIFF_TILE_SIZE - 1) / TIFF_TILE_SIZE;
+  uint64_t tile_count = (uint64_t)writer.tiles_across * writer.tiles_down;
+  uint64_t tables_end = tables_offset() + 2 * tile_count * sizeof(uint64_t);
+  writer.data_offset = (tables_end + 4095) & ~(uint64_t)4095;
+
+  if (resume) {
+    writer.file = open(path.c_str(), O_RDWR);
+    struct stat info;
+    if (writer.file >= 0 && fstat(writer.file, &info) == 0 && (uint64_t)info.st_size == file_size(writer) && header_matches(writer)) {
+      writer.buffer.resize(writer.tiles_across * TIFF_TILE_BYTES);
+      return true;
+    }
+    tiff_close(writer);
+    return false;
+  }
+
+  writer.file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (writer.file < 0 || ftruncate(writer.file, file_size(writer)) != 0 || !write_header(writer)) {
+    tiff_close(writer);
+    return false;
+  }
+  writer.buffer.resize(writer.tiles_across * TIFF_TILE_BYTES);
+  return true;
+}
+
+bool tiff_write_tile_row(TiffWriter& writer, int tile_row, const Rgba* pixels) {
+  int rows = min(TIFF_TILE_SIZE, writer.height - tile_row * TIFF_TILE_SIZE);
+  // Padding beyond the image edge is black
+  fill(writer.buffer.begin(), writer.buffer.end(), 0);
+  for (int tile = 0; tile < writer.tiles_across; tile++) {
+    uint8_t* out = writer.buffer.data() + tile * TIFF_TILE_BYTES;
+    int x0 = tile * TIFF_TILE_SIZE;
+    int columns = min(TIFF_TILE_SIZE, writer.width - x0);
+    for (int y = 0; y < rows; y++) {
+      const Rgba* row = pixels + (size_t)y * writer.width + x0;
+      uint8_t* to = out + (size_t)y * TIFF_TILE_SIZE * 3;
+      for (int x = 0; x < columns; x++) {
+        to[x * 3 + 0] = row[x].r;
+        to[x * 3 + 1] = row[x].g;
+        to[x * 3 + 2] = row[x].b;
+      }
+    }
+  }
+  // The tiles of a row are consecutive in the file
+  uint64_t offset = writer.data_offset + (uint64_t)tile_row * writer.tiles_across * TIFF_TILE_BYTES;
+  return write_all(writer.file, writer.buffer.data(), writer.buffer.size(), offset);
+}
+
+bool tiff_sync(TiffWriter& writer) {
+  return fdatasync(writer.file) == 0;
+}
+
+bool tiff_close(TiffWriter& writer) {
+  bool ok = true;
+  if (writer.file >= 0) {
+    ok = close(writer.file) == 0;
+  }
+  writer.file = -1;
+  return ok;
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "color.h"
+
+// Side of the square tiles, also the height of the bands they are written in
+const int TIFF_TILE_SIZE = 256;
+
+// Tiled BigTIFF with uncompressed 8 bit RGB tiles. Every tile has a fixed size and position, so the
+// header and the tile tables are written when the file is created and rows of tiles can be filled
+// in any order, also by a later process continuing an interrupted render. The file is created
+// sparse at its full size
+struct TiffWriter {
+  int file = -1;
+  int width = 0;
+  int height = 0;
+  int tiles_across = 0;
+  int tiles_down = 0;
+  uint64_t data_offset = 0;
+
+  // One row of tiles, reused between rows
+  std::vector<uint8_t> buffer;
+};
+
+// With resume an existing file with the same size and layout is kept as it is instead of being recreated
+bool tiff_open(TiffWriter& writer, const std::string& path, int width, int height, bool resume);
+
+// Writes tile row tile_row from pixels, which holds the TIFF_TILE_SIZE image rows of that tile row
+// (fewer for the last one) at the image width
+bool tiff_write_tile_row(TiffWriter& writer, int tile_row, const Rgba* pixels);
+
+// Waits until everything written so far is on disk
+bool tiff_sync(TiffWriter& writer);
+
+bool tiff_close(TiffWriter& writer);
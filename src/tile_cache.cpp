@@ -0,0 +1,246 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include "tile_cache.h"
+#include "tile_store.h"
+
+using namespace std;
+
+// Global pixel indices have to stay exact in a double, also after adding the screen size
+const double MAX_LATTICE_INDEX = 0x1p52;
+
+const size_t TILE_BYTES = (size_t)CACHE_TILE_SIZE * CACHE_TILE_SIZE * (sizeof(uint16_t) + sizeof(uint8_t));
+
+size_t TileKeyHash::operator()(const TileKey& key) const {
+  uint64_t tol_bits;
+  memcpy(&tol_bits, &key.tol, sizeof(tol_bits));
+  uint64_t fields[] = {(uint64_t)key.level, (uint64_t)key.tx, (uint64_t)key.ty, (uint64_t)key.n, (uint64_t)key.max_iter, tol_bits, (uint64_t)key.precision};
+  uint64_t hash = 0xcbf29ce484222325;
+  for (uint64_t field : fields) {
+    hash = (hash ^ field) * 0x100000001b3;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+// The tiles covering a view. Pixel (0, 0) of the view is global pixel (x0, y0) of its level
+struct TileSpan {
+  int64_t x0;
+  int64_t y0;
+  int64_t tx0;
+  int64_t ty0;
+  int columns;
+  int rows;
+};
+
+static int64_t floor_div(int64_t a, int64_t b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+static bool tile_span(int screen_height, int screen_width, DoubleDouble x_pos, DoubleDouble y_pos, double zoom, TileSpan& span) {
+  DoubleDouble x_center = x_pos * zoom;
+  DoubleDouble y_center = y_pos * zoom;
+  if (!(fabs(x_center.hi) < MAX_LATTICE_INDEX && fabs(y_center.hi) < MAX_LATTICE_INDEX)) {
+    return false;
+  }
+  // Pixel screen_width / 2 sits on the view center
+  span.x0 = llround(x_center.hi + x_center.lo) - screen_width / 2;
+  span.y0 = llround(y_center.hi + y_center.lo) - screen_height / 2;
+  span.tx0 = floor_div(span.x0, CACHE_TILE_SIZE);
+  span.ty0 = floor_div(span.y0, CACHE_TILE_SIZE);
+  span.columns = (int)(floor_div(span.x0 + screen_width - 1, CACHE_TILE_SIZE) - span.tx0 + 1);
+  span.rows = (int)(floor_div(span.y0 + screen_height - 1, CACHE_TILE_SIZE) - span.ty0 + 1);
+  return true;
+}
+
+DoubleDouble snap_to_pixel(DoubleDouble pos, double zoom) {
+  DoubleDouble pixel = pos * zoom;
+  if (!(fabs(pixel.hi) < MAX_LATTICE_INDEX)) {
+    return pos;
+  }
+  return DoubleDouble((double)llround(pixel.hi + pixel.lo)) / zoom;
+}
+
+static CachedTile* tile_cache_find(TileCache& cache, const TileKey& key) {
+  auto found = cache.index.find(key);
+  if (found == cache.index.end()) {
+    return nullptr;
+  }
+  cache.tiles.splice(cache.tiles.begin(), cache.tiles, found->second);
+  return &*found->second;
+}
+
+// Copy between a contiguous tile and the tile at (column, row) of a grid columns tiles wide
+static void tile_from_grid(Grid from, int columns, int column, int row, uint16_t* depth, uint8_t* root) {
+  int width = columns * CACHE_TILE_SIZE;
+  for (int y = 0; y < CACHE_TILE_SIZE; y++) {
+    size_t offset = (size_t)(row * CACHE_TILE_SIZE + y) * width + column * CACHE_TILE_SIZE;
+    memcpy(depth + y * CACHE_TILE_SIZE, from.depth + offset, CACHE_TILE_SIZE * sizeof(uint16_t));
+    memcpy(root + y * CACHE_TILE_SIZE, from.root + offset, CACHE_TILE_SIZE * sizeof(uint8_t));
+  }
+}
+
+static void tile_to_grid(Grid to, int columns, int column, int row, const uint16_t* depth, const uint8_t* root) {
+  int width = columns * CACHE_TILE_SIZE;
+  for (int y = 0; y < CACHE_TILE_SIZE; y++) {
+    size_t offset = (size_t)(row * CACHE_TILE_SIZE + y) * width + column * CACHE_TILE_SIZE;
+    memcpy(to.depth + offset, depth + y * CACHE_TILE_SIZE, CACHE_TILE_SIZE * sizeof(uint16_t));
+    memcpy(to.root + offset, root + y * CACHE_TILE_SIZE, CACHE_TILE_SIZE * sizeof(uint8_t));
+  }
+}
+
+static void tile_cache_insert(TileCache& cache, const TileKey& key, const uint16_t* depth, const uint8_t* root) {
+  if (cache.budget < TILE_BYTES) {
+    return;
+  }
+  while (cache.used + TILE_BYTES > cache.budget) {
+    cache.index.erase(cache.tiles.back().key);
+    cache.tiles.pop_back();
+    cache.used -= TILE_BYTES;
+    cache.evictions++;
+  }
+
+  CachedTile& tile = cache.tiles.emplace_front();
+  tile.key = key;
+  tile.depth.assign(depth, depth + CACHE_TILE_SIZE * CACHE_TILE_SIZE);
+  tile.root.assign(root, root + CACHE_TILE_SIZE * CACHE_TILE_SIZE);
+  cache.index[key] = cache.tiles.begin();
+  cache.used += TILE_BYTES;
+}
+
+int tile_cache_missing(
+    TileCache& cache,
+    int screen_height,
+    int screen_width,
+    DoubleDouble x_pos,
+    DoubleDouble y_pos,
+    int n,
+    int max_iter,
+    double tol,
+    double zoom,
+    int level,
+    ispc::Precision precision
+  ){
+
+  TileSpan span;
+  if (!tile_span(screen_height, screen_width, x_pos, y_pos, zoom, span)) {
+    return -1;
+  }
+  int missing = 0;
+  for (int row = 0; row < span.rows; row++) {
+    for (int column = 0; column < span.columns; column++) {
+      TileKey key = {level, span.tx0 + column, span.ty0 + row, n, max_iter, tol, precision};
+      missing += !cache.index.contains(key) && !(cache.store && tile_store_contains(*cache.store, key));
+    }
+  }
+  return missing;
+}
+
+int fractal_cached(
+    TileCache& cache,
+    Mode mode,
+    ispc::Precision precision,
+    Grid grid,
+    int screen_height,
+    int screen_width,
+    DoubleDouble x_pos,
+    DoubleDouble y_pos,
+    int n,
+    int max_iter,
+    double tol,
+    double zoom,
+    int level,
+    int task_count,
+    int tile_size,
+    Generation generation
+  ){
+
+  TileSpan span;
+  if (!tile_span(screen_height, screen_width, x_pos, y_pos, zoom, span)) {
+    fractal(mode, precision, grid, screen_height, screen_width, x_pos, y_pos, n, max_iter, tol, zoom, task_count, tile_size, nullptr, 0, generation);
+    return -1;
+  }
+  if (mode == SIMD) {
+    task_count = 1;
+  }
+
+  // The scratch grid is a view of its own whose pixels land exactly on the global lattice
+  int scratch_width = span.columns * CACHE_TILE_SIZE;
+  int scratch_height = span.rows * CACHE_TILE_SIZE;
+  cache.scratch_depth.resize((size_t)scratch_width * scratch_height);
+  cache.scratch_root.resize((size_t)scratch_width * scratch_height);
+  Grid scratch = {cache.scratch_depth.data(), cache.scratch_root.data()};
+  DoubleDouble scratch_x = DoubleDouble((double)(span.tx0 * CACHE_TILE_SIZE + scratch_width / 2)) / zoom;
+  DoubleDouble scratch_y = DoubleDouble((double)(span.ty0 * CACHE_TILE_SIZE + scratch_height / 2)) / zoom;
+
+  uint16_t tile_depth[CACHE_TILE_SIZE * CACHE_TILE_SIZE];
+  uint8_t tile_root[CACHE_TILE_SIZE * CACHE_TILE_SIZE];
+  vector<bool> cached(span.columns * span.rows);
+  int missing = 0;
+  for (int row = 0; row < span.rows; row++) {
+    for (int column = 0; column < span.columns; column++) {
+      TileKey key = {level, span.tx0 + column, span.ty0 + row, n, max_iter, tol, precision};
+      if (CachedTile* tile = tile_cache_find(cache, key)) {
+        cache.hits++;
+        tile_to_grid(scratch, span.columns, column, row, tile->depth.data(), tile->root.data());
+      } else if (cache.store && tile_store_load(*cache.store, key, tile_depth, tile_root)) {
+        cache.loaded++;
+        tile_cache_insert(cache, key, tile_depth, tile_root);
+        tile_to_grid(scratch, span.columns, column, row, tile_depth, tile_root);
+      } else {
+        missing++;
+        cache.misses++;
+        continue;
+      }
+      cached[row * span.columns + column] = true;
+    }
+  }
+
+  // Runs of missing tiles along a row are computed together, a cold frame in a single launch
+  if (missing == span.columns * span.rows) {
+    fractal_region(precision, scratch, scratch_height, scratch_width, scratch_x, scratch_y, n, max_iter, tol, zoom, 0, 0, scratch_width, scratch_height, task_count, tile_size, generation);
+  } else {
+    for (int row = 0; row < span.rows; row++) {
+      int column = 0;
+      while (column < span.columns) {
+        if (cached[row * span.columns + column]) {
+          column++;
+          continue;
+        }
+        int run_end = column;
+        while (run_end < span.columns && !cached[row * span.columns + run_end]) {
+          run_end++;
+        }
+        fractal_region(precision, scratch, scratch_height, scratch_width, scratch_x, scratch_y, n, max_iter, tol, zoom,
+          column * CACHE_TILE_SIZE, row * CACHE_TILE_SIZE, run_end * CACHE_TILE_SIZE, (row + 1) * CACHE_TILE_SIZE, task_count, tile_size, generation);
+        column = run_end;
+      }
+    }
+  }
+  // Tiles the kernel skipped hold garbage, the frame is thrown away anyway
+  if (generation.stale()) {
+    return missing;
+  }
+
+  for (int row = 0; row < span.rows; row++) {
+    for (int column = 0; column < span.columns; column++) {
+      if (!cached[row * span.columns + column]) {
+        TileKey key = {level, span.tx0 + column, span.ty0 + row, n, max_iter, tol, precision};
+        tile_from_grid(scratch, span.columns, column, row, tile_depth, tile_root);
+        tile_cache_insert(cache, key, tile_depth, tile_root);
+        if (cache.store) {
+          tile_store_save(*cache.store, key, tile_depth, tile_root);
+        }
+      }
+    }
+  }
+
+  int offset_x = (int)(span.x0 - span.tx0 * CACHE_TILE_SIZE);
+  int offset_y = (int)(span.y0 - span.ty0 * CACHE_TILE_SIZE);
+  for (int y = 0; y < screen_height; y++) {
+    size_t from = (size_t)(y + offset_y) * scratch_width + offset_x;
+    memcpy(grid.depth + (size_t)y * screen_width, scratch.depth + from, screen_width * sizeof(uint16_t));
+    memcpy(grid.root + (size_t)y * screen_width, scratch.root + from, screen_width * sizeof(uint8_t));
+  }
+  return missing;
+}
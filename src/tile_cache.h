@@ -0,0 +1,103 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+#include "fractal.h"
+
+// Side of the cached tiles. Frames are computed in whole tiles, so every frame overscans by up
+// to a tile on each side
+const int CACHE_TILE_SIZE = 32;
+
+// Tiles are laid out like map tiles. At every zoom level the plane is cut into a fixed grid
+// of CACHE_TILE_SIZE pixel squares, tile (tx, ty) covers the pixels at
+// [tx * CACHE_TILE_SIZE, (tx + 1) * CACHE_TILE_SIZE) / zoom and the same for y. The level names the
+// zoom, callers have to pass the same zoom whenever they pass the same level
+struct TileKey {
+  int level;
+  int64_t tx;
+  int64_t ty;
+  int n;
+  int max_iter;
+  double tol;
+  ispc::Precision precision;
+
+  bool operator==(const TileKey& other) const = default;
+};
+
+struct TileKeyHash {
+  size_t operator()(const TileKey& key) const;
+};
+
+struct TileStore;
+
+struct CachedTile {
+  TileKey key;
+  std::vector<uint16_t> depth;
+  std::vector<uint8_t> root;
+};
+
+// Computed tiles, least recently used ones are evicted to stay within budget bytes of tile data.
+// With a store, tiles missing in memory are looked up there before computing them and every
+// computed tile is saved to it
+struct TileCache {
+  size_t budget = 0;
+  size_t used = 0;
+  TileStore* store = nullptr;
+
+  // Most recently used first
+  std::list<CachedTile> tiles;
+  std::unordered_map<TileKey, std::list<CachedTile>::iterator, TileKeyHash> index;
+
+  // Frames are assembled in a tile aligned grid around the view, reused between frames
+  std::vector<uint16_t> scratch_depth;
+  std::vector<uint8_t> scratch_root;
+
+  long hits = 0;
+  long misses = 0;
+  long evictions = 0;
+  long loaded = 0;
+};
+
+// Moves pos onto the nearest pixel of the tile lattice at this zoom. Views that are snapped and
+// pan by whole pixels stay on the lattice, so their tiles line up with the cached ones
+DoubleDouble snap_to_pixel(DoubleDouble pos, double zoom);
+
+// Number of tiles of the view that are neither in memory nor in the store, -1 when the view is
+// too deep for the tile indices to be exact in a double and it can't be cached
+int tile_cache_missing(
+  TileCache& cache,
+  int screen_height,
+  int screen_width,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  int n,
+  int max_iter,
+  double tol,
+  double zoom,
+  int level,
+  ispc::Precision precision
+);
+
+// Fills the grid from the cached or stored tiles and computes only the missing ones with the SIMD
+// or SIMD_THREADED kernel, which are then cached and stored too. The view center is snapped with
+// snap_to_pixel. Returns the number of tiles computed, a frame that went stale caches nothing
+int fractal_cached(
+  TileCache& cache,
+  Mode mode,
+  ispc::Precision precision,
+  Grid grid,
+  int screen_height,
+  int screen_width,
+  DoubleDouble x_pos,
+  DoubleDouble y_pos,
+  int n,
+  int max_iter,
+  double tol,
+  double zoom,
+  int level,
+  int task_count,
+  int tile_size,
+  Generation generation
+);
@@ -0,0 +1,278 @@
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tile_store.h"
+
+using namespace std;
+
+const char TILE_STORE_MAGIC[8] = {'N', 'F', 'T', 'I', 'L', 'E', 'S', '\0'};
+const int TILE_PIXELS = CACHE_TILE_SIZE * CACHE_TILE_SIZE;
+const size_t TILE_RAW_BYTES = TILE_PIXELS * (sizeof(uint16_t) + sizeof(uint8_t));
+
+// First byte of every stored tile
+enum TileEncoding : uint8_t {
+  TILE_RAW,
+  TILE_RUNS
+};
+
+static size_t index_offset() {
+  return (sizeof(TileStoreHeader) + 63) & ~(size_t)63;
+}
+
+static size_t blocks_offset() {
+  return index_offset() + TILE_STORE_INDEX_CAPACITY * sizeof(TileStoreEntry);
+}
+
+static uint8_t* put_varint(uint8_t* out, uint32_t value) {
+  while (value >= 0x80) {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+static const uint8_t* get_varint(const uint8_t* in, const uint8_t* end, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; in < end && shift < 32; shift += 7) {
+    uint8_t byte = *in++;
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return in;
+    }
+  }
+  return nullptr;
+}
+
+// Runs of equal values, each stored as its length and the zigzag delta to the previous run's value.
+// Basin interiors and the root plane collapse to a few bytes per row
+template <typename T>
+static uint8_t* encode_runs(const T* values, int count, uint8_t* out) {
+  int previous = 0;
+  int i = 0;
+  while (i < count) {
+    int run = 1;
+    while (i + run < count && values[i + run] == values[i]) {
+      run++;
+    }
+    int delta = (int)values[i] - previous;
+    out = put_varint(out, run);
+    out = put_varint(out, (uint32_t)((delta << 1) ^ (delta >> 31)));
+    previous = values[i];
+    i += run;
+  }
+  return out;
+}
+
+template <typename T>
+static const uint8_t* decode_runs(const uint8_t* in, const uint8_t* end, T* values, int count) {
+  int previous = 0;
+  int i = 0;
+  while (i < count) {
+    uint32_t run;
+    uint32_t zigzag;
+    if (!(in = get_varint(in, end, run)) || !(in = get_varint(in, end, zigzag)) || run == 0 || run > (uint32_t)(count - i)) {
+      return nullptr;
+    }
+    int value = previous + (int)((zigzag >> 1) ^ -(zigzag & 1));
+    for (uint32_t j = 0; j < run; j++) {
+      values[i++] = (T)value;
+    }
+    previous = value;
+  }
+  return in;
+}
+
+// Acquire pairs with the release in tile_store_save, an entry read as written has its fields and data in place
+static bool entry_written(const TileStoreEntry& entry) {
+  return __atomic_load_n(&entry.written, __ATOMIC_ACQUIRE) != 0;
+}
+
+static bool entry_matches(const TileStoreEntry& entry, const TileKey& key) {
+  return entry.level == key.level && entry.tx == key.tx && entry.ty == key.ty && entry.n == key.n &&
+    entry.max_iter == key.max_iter && entry.tol == key.tol && entry.precision == (int32_t)key.precision;
+}
+
+// The entry holding key, or the empty slot it would go into. nullptr if neither is found
+static TileStoreEntry* find_entry(const TileStore& store, const TileKey& key) {
+  uint64_t capacity = store.header->index_capacity;
+  uint64_t slot = TileKeyHash()(key) % capacity;
+  for (uint64_t probe = 0; probe < capacity; probe++) {
+    TileStoreEntry& entry = store.index[(slot + probe) % capacity];
+    if (!entry_written(entry) || entry_matches(entry, key)) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+bool tile_store_open(TileStore& store, const string& path, size_t size) {
+  store.file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (store.file < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(store.file, &info) != 0) {
+    tile_store_close(store);
+    return false;
+  }
+
+  bool created = info.st_size == 0;
+  if (created) {
+    if (size < blocks_offset() + TILE_STORE_BLOCK_SIZE || ftruncate(store.file, size) != 0) {
+      tile_store_close(store);
+      return false;
+    }
+  } else {
+    size = info.st_size;
+    // Mapping a file shorter than the header and index would fault on the first read past its end
+    if (size < blocks_offset() + TILE_STORE_BLOCK_SIZE) {
+      fprintf(stderr, "%s is too small to be a tile store\n", path.c_str());
+      tile_store_close(store);
+      return false;
+    }
+  }
+
+  void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, store.file, 0);
+  if (map == MAP_FAILED) {
+    tile_store_close(store);
+    return false;
+  }
+  store.map = (uint8_t*)map;
+  store.size = size;
+  store.header = (TileStoreHeader*)store.map;
+  store.index = (TileStoreEntry*)(store.map + index_offset());
+  store.blocks = store.map + blocks_offset();
+
+  TileStoreHeader& header = *store.header;
+  if (created) {
+    memcpy(header.magic, TILE_STORE_MAGIC, sizeof(header.magic));
+    header.version = TILE_STORE_VERSION;
+    header.tile_size = CACHE_TILE_SIZE;
+    header.index_capacity = TILE_STORE_INDEX_CAPACITY;
+    header.block_size = TILE_STORE_BLOCK_SIZE;
+    header.block_capacity = (size - blocks_offset()) / TILE_STORE_BLOCK_SIZE;
+    header.blocks_used = 0;
+    header.tile_count = 0;
+  }
+
+  // A store written with other tile or layout parameters is left alone rather than misread
+  bool valid = memcmp(header.magic, TILE_STORE_MAGIC, sizeof(header.magic)) == 0 &&
+    header.version == TILE_STORE_VERSION && header.tile_size == CACHE_TILE_SIZE &&
+    header.index_capacity == TILE_STORE_INDEX_CAPACITY && header.block_size == TILE_STORE_BLOCK_SIZE &&
+    header.block_capacity <= (size - blocks_offset()) / TILE_STORE_BLOCK_SIZE && header.blocks_used <= header.block_capacity;
+  if (!valid) {
+    fprintf(stderr, "%s is not a tile store of this version\n", path.c_str());
+    tile_store_close(store);
+    return false;
+  }
+  // Worst case every pixel is a run of its own
+  store.buffer.resize(TILE_PIXELS * 10);
+  return true;
+}
+
+void tile_store_close(TileStore& store) {
+  if (store.map) {
+    msync(store.map, store.size, MS_SYNC);
+    munmap(store.map, store.size);
+  }
+  if (store.file >= 0) {
+    close(store.file);
+  }
+  store.file = -1;
+  store.map = nullptr;
+  store.size = 0;
+  store.header = nullptr;
+  store.index = nullptr;
+  store.blocks = nullptr;
+}
+
+bool tile_store_contains(const TileStore& store, const TileKey& key) {
+  TileStoreEntry* entry = find_entry(store, key);
+  return entry && entry_written(*entry);
+}
+
+bool tile_store_load(TileStore& store, const TileKey& key, uint16_t* depth, uint8_t* root) {
+  TileStoreEntry* entry = find_entry(store, key);
+  if (!entry || !entry_written(*entry)) {
+    return false;
+  }
+  // block comes from the file, checked on its own before it is scaled so a corrupt index can't wrap
+  // the bounds check around. block_capacity was checked against the file size when it was opened
+  uint64_t block_capacity = store.header->block_capacity;
+  if (entry->length == 0 || entry->block >= block_capacity || entry->length > (block_capacity - entry->block) * TILE_STORE_BLOCK_SIZE) {
+    return false;
+  }
+  const uint8_t* data = store.blocks + entry->block * TILE_STORE_BLOCK_SIZE;
+  const uint8_t* end = data + entry->length;
+
+  if (data[0] == TILE_RAW) {
+    if (entry->length != 1 + TILE_RAW_BYTES) {
+      return false;
+    }
+    memcpy(depth, data + 1, TILE_PIXELS * sizeof(uint16_t));
+    memcpy(root, data + 1 + TILE_PIXELS * sizeof(uint16_t), TILE_PIXELS * sizeof(uint8_t));
+  } else {
+    const uint8_t* in = decode_runs(data + 1, end, depth, TILE_PIXELS);
+    if (!in || !decode_runs(in, end, root, TILE_PIXELS)) {
+      return false;
+    }
+  }
+  store.loads++;
+  return true;
+}
+
+bool tile_store_save(TileStore& store, const TileKey& key, const uint16_t* depth, const uint8_t* root) {
+  TileStoreHeader& header = *store.header;
+  // Linear probing slows down sharply once the index fills up
+  if (header.tile_count >= header.index_capacity / 4 * 3) {
+    return false;
+  }
+  TileStoreEntry* entry = find_entry(store, key);
+  if (!entry) {
+    return false;
+  }
+  if (entry_written(*entry)) {
+    return true;
+  }
+
+  // Stored as is when the runs don't pay off, e.g. at deep zoom where every pixel differs
+  uint8_t* out = store.buffer.data();
+  out[0] = TILE_RUNS;
+  uint8_t* end = encode_runs(depth, TILE_PIXELS, out + 1);
+  end = encode_runs(root, TILE_PIXELS, end);
+  size_t length = end - out;
+  if (length >= 1 + TILE_RAW_BYTES) {
+    out[0] = TILE_RAW;
+    memcpy(out + 1, depth, TILE_PIXELS * sizeof(uint16_t));
+    memcpy(out + 1 + TILE_PIXELS * sizeof(uint16_t), root, TILE_PIXELS * sizeof(uint8_t));
+    length = 1 + TILE_RAW_BYTES;
+  }
+
+  uint64_t block_count = (length + TILE_STORE_BLOCK_SIZE - 1) / TILE_STORE_BLOCK_SIZE;
+  if (header.blocks_used + block_count > header.block_capacity) {
+    return false;
+  }
+  // The blocks are reserved first and the entry published last, a crash in between leaks the blocks
+  // but never leaves an entry pointing at blocks another tile may reuse
+  uint64_t block = header.blocks_used;
+  header.blocks_used += block_count;
+  header.tile_count++;
+  memcpy(store.blocks + block * TILE_STORE_BLOCK_SIZE, out, length);
+
+  entry->level = key.level;
+  entry->tx = key.tx;
+  entry->ty = key.ty;
+  entry->n = key.n;
+  entry->max_iter = key.max_iter;
+  entry->tol = key.tol;
+  entry->precision = key.precision;
+  entry->length = (uint32_t)length;
+  entry->block = block;
+  __atomic_store_n(&entry->written, 1, __ATOMIC_RELEASE);
+  store.saves++;
+  return true;
+}
@@ -0,0 +1,72 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "tile_cache.h"
+
+// Layout of the store file, all native endian:
+// [header][index of TILE_STORE_INDEX_CAPACITY entries][blocks of TILE_STORE_BLOCK_SIZE bytes]
+// The file is created sparse at its full size. Tiles are compressed and appended to the blocks,
+// so only the index entries and blocks that were written take up disk space
+const uint32_t TILE_STORE_VERSION = 1;
+const uint64_t TILE_STORE_INDEX_CAPACITY = 1 << 20;
+const uint64_t TILE_STORE_BLOCK_SIZE = 256;
+
+struct TileStoreHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t tile_size;
+  uint64_t index_capacity;
+  uint64_t block_size;
+  uint64_t block_capacity;
+  uint64_t blocks_used;
+  uint64_t tile_count;
+};
+
+// Slot of the open addressing index. written is set last, an entry torn by a crash is empty
+struct TileStoreEntry {
+  uint32_t written;
+  int32_t level;
+  int64_t tx;
+  int64_t ty;
+  int32_t n;
+  int32_t max_iter;
+  double tol;
+  int32_t precision;
+  // Compressed bytes starting at block
+  uint32_t length;
+  uint64_t block;
+  uint64_t padding;
+};
+
+static_assert(sizeof(TileStoreEntry) == 64, "the index layout is part of the file format");
+
+// A single file of computed tiles that outlives the process, accessed through one shared mapping.
+// Tiles are never overwritten or evicted, once the index or the blocks are full nothing more is saved
+struct TileStore {
+  int file = -1;
+  uint8_t* map = nullptr;
+  size_t size = 0;
+  TileStoreHeader* header = nullptr;
+  TileStoreEntry* index = nullptr;
+  uint8_t* blocks = nullptr;
+
+  // Compression buffer, reused between tiles
+  std::vector<uint8_t> buffer;
+
+  long loads = 0;
+  long saves = 0;
+};
+
+// Opens the store at path, creating it with room for size bytes if it doesn't exist yet
+bool tile_store_open(TileStore& store, const std::string& path, size_t size);
+void tile_store_close(TileStore& store);
+
+bool tile_store_contains(const TileStore& store, const TileKey& key);
+
+// Decompresses the tile into CACHE_TILE_SIZE x CACHE_TILE_SIZE planes, false if it isn't stored
+bool tile_store_load(TileStore& store, const TileKey& key, uint16_t* depth, uint8_t* root);
+
+// Returns false when the store is full
+bool tile_store_save(TileStore& store, const TileKey& key, const uint16_t* depth, const uint8_t* root);
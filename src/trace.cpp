@@ -0,0 +1,212 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+#include "trace.h"
+
+using namespace std;
+
+enum TraceKind : uint8_t {
+  TRACE_TASK,
+  TRACE_TILE,
+  TRACE_SYNC,
+  TRACE_IDLE
+};
+
+const char* const TRACE_KIND_NAME[] = {
+  "task",
+  "tile",
+  "sync",
+  "idle"
+};
+
+struct TraceEvent {
+  uint64_t start;
+  uint64_t end;
+  int64_t iterations;
+  // Task function of a task, distinguishes the kernels
+  const void* function;
+  // Index and count of a task, the corners of a tile
+  int32_t values[4];
+  TraceKind kind;
+};
+
+// Only the owning thread writes. head counts the events ever written and is published after the
+// event, so a reader sees complete events below it
+struct TraceRing {
+  int id;
+  char name[32];
+  atomic<uint64_t> head{0};
+
+  // Start of the open tile, the end of the previous one or the start of the task. 0 outside tasks
+  uint64_t mark = 0;
+  int64_t task_iterations = 0;
+  uint64_t idle_start = 0;
+
+  TraceEvent events[TRACE_RING_EVENTS];
+};
+
+atomic<bool> trace_on{false};
+
+static mutex rings_mutex;
+// Rings outlive their threads, their events still show up in the next dump
+static vector<TraceRing*> rings;
+static uint64_t trace_origin = 0;
+
+static thread_local TraceRing* own_ring = nullptr;
+static thread_local char thread_name[32] = "";
+
+static uint64_t now() {
+  return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Rings are only allocated once a thread records while tracing is on
+static TraceRing* current_ring() {
+  if (!own_ring) {
+    TraceRing* created = new TraceRing;
+    lock_guard<mutex> lock(rings_mutex);
+    created->id = (int)rings.size();
+    if (thread_name[0]) {
+      memcpy(created->name, thread_name, sizeof(created->name));
+    } else {
+      snprintf(created->name, sizeof(created->name), "thread %d", created->id);
+    }
+    rings.push_back(created);
+    own_ring = created;
+  }
+  return own_ring;
+}
+
+static void record(TraceRing* ring, TraceKind kind, uint64_t start, uint64_t end, int64_t iterations, const void* function,
+    int32_t a, int32_t b, int32_t c, int32_t d) {
+  uint64_t head = ring->head.load(memory_order_relaxed);
+  TraceEvent& event = ring->events[head % TRACE_RING_EVENTS];
+  event = {start, end, iterations, function, {a, b, c, d}, kind};
+  ring->head.store(head + 1, memory_order_release);
+}
+
+// Closes an open idle span at end
+static void end_idle(TraceRing* ring, uint64_t end) {
+  if (ring->idle_start) {
+    record(ring, TRACE_IDLE, ring->idle_start, end, 0, nullptr, 0, 0, 0, 0);
+    ring->idle_start = 0;
+  }
+}
+
+void trace_start() {
+  lock_guard<mutex> lock(rings_mutex);
+  for (TraceRing* ring : rings) {
+    ring->head.store(0, memory_order_relaxed);
+  }
+  trace_origin = now();
+  trace_on.store(true, memory_order_release);
+}
+
+void trace_stop() {
+  trace_on.store(false, memory_order_release);
+}
+
+void trace_thread_name(const char* name) {
+  snprintf(thread_name, sizeof(thread_name), "%s", name);
+  if (own_ring) {
+    memcpy(own_ring->name, thread_name, sizeof(own_ring->name));
+  }
+}
+
+uint64_t trace_task_begin() {
+  if (!trace_enabled()) {
+    return 0;
+  }
+  TraceRing* ring = current_ring();
+  uint64_t start = now();
+  end_idle(ring, start);
+  ring->mark = start;
+  ring->task_iterations = 0;
+  return start;
+}
+
+void trace_task_end(uint64_t start, const void* function, int task_index, int task_count) {
+  if (!start || !trace_enabled()) {
+    return;
+  }
+  TraceRing* ring = current_ring();
+  record(ring, TRACE_TASK, start, now(), ring->task_iterations, function, task_index, task_count, 0, 0);
+  ring->mark = 0;
+}
+
+uint64_t trace_sync_begin() {
+  return trace_enabled() ? now() : 0;
+}
+
+void trace_sync_end(uint64_t start) {
+  if (!start || !trace_enabled()) {
+    return;
+  }
+  TraceRing* ring = current_ring();
+  uint64_t end = now();
+  end_idle(ring, end);
+  record(ring, TRACE_SYNC, start, end, 0, nullptr, 0, 0, 0, 0);
+}
+
+void trace_idle() {
+  if (!trace_enabled()) {
+    return;
+  }
+  TraceRing* ring = current_ring();
+  if (!ring->idle_start) {
+    ring->idle_start = now();
+  }
+}
+
+extern "C" void trace_tile(int32_t x0, int32_t y0, int32_t x1, int32_t y1, int64_t iterations) {
+  if (!trace_enabled()) {
+    return;
+  }
+  TraceRing* ring = current_ring();
+  // A task that started before tracing was switched on has no start to measure from
+  if (!ring->mark) {
+    return;
+  }
+  uint64_t end = now();
+  record(ring, TRACE_TILE, ring->mark, end, iterations, nullptr, x0, y0, x1, y1);
+  ring->mark = end;
+  ring->task_iterations += iterations;
+}
+
+// Timestamps are microseconds since trace_start, as the format expects
+bool trace_write_json(const string& path) {
+  FILE* file = fopen(path.c_str(), "w");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"newton-fractal\"}}");
+
+  lock_guard<mutex> lock(rings_mutex);
+  for (TraceRing* ring : rings) {
+    fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", ring->id, ring->name);
+
+    // The oldest slot is skipped, it is the one a late writer would overwrite next
+    uint64_t head = ring->head.load(memory_order_acquire);
+    uint64_t first = head >= TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS + 1 : 0;
+    for (uint64_t i = first; i < head; i++) {
+      const TraceEvent& event = ring->events[i % TRACE_RING_EVENTS];
+      if (event.start < trace_origin) {
+        continue;
+      }
+      fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+        TRACE_KIND_NAME[event.kind], TRACE_KIND_NAME[event.kind], ring->id, (event.start - trace_origin) * 1e-3, (event.end - event.start) * 1e-3);
+      if (event.kind == TRACE_TASK) {
+        fprintf(file, ",\"args\":{\"function\":\"%p\",\"index\":%d,\"count\":%d,\"iterations\":%lld}",
+          event.function, event.values[0], event.values[1], (long long)event.iterations);
+      } else if (event.kind == TRACE_TILE) {
+        fprintf(file, ",\"args\":{\"x0\":%d,\"y0\":%d,\"x1\":%d,\"y1\":%d,\"iterations\":%lld}",
+          event.values[0], event.values[1], event.values[2], event.values[3], (long long)event.iterations);
+      }
+      fprintf(file, "}");
+    }
+  }
+  fprintf(file, "\n]}\n");
+  return fclose(file) == 0;
+}
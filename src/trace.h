@@ -0,0 +1,46 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Execution tracing of the task systems and kernels. Every thread records into a ring buffer of its
+// own, so recording takes no locks and the latest TRACE_RING_EVENTS events per thread are kept.
+// While tracing is off each hook costs a relaxed load. The rings are written out in the Chrome trace
+// event format, which Perfetto and chrome://tracing open directly
+
+// Events kept per thread, older ones are overwritten
+const int TRACE_RING_EVENTS = 1 << 16;
+
+extern std::atomic<bool> trace_on;
+
+inline bool trace_enabled() {
+  return trace_on.load(std::memory_order_relaxed);
+}
+
+// Drops everything recorded so far and starts recording
+void trace_start();
+
+void trace_stop();
+
+// Writes the recorded events as a Chrome trace JSON file. Call after trace_stop, an event that a
+// still running task records at that moment may be left out
+bool trace_write_json(const std::string& path);
+
+// Name of the calling thread in the trace, "thread <i>" if it never sets one
+void trace_thread_name(const char* name);
+
+// Hooks for the task systems. trace_task_begin returns 0 while tracing is off, the end hooks ignore a
+// start of 0. A task's iterations are the sum of the tiles it reported with trace_tile
+uint64_t trace_task_begin();
+void trace_task_end(uint64_t start, const void* function, int task_index, int task_count);
+
+// ISPCSync from begin to end, tasks the syncing thread runs meanwhile nest inside
+uint64_t trace_sync_begin();
+void trace_sync_end(uint64_t start);
+
+// The calling thread found no work. The idle span lasts until its next task starts or its sync ends
+void trace_idle();
+
+// Called by the kernels after every tile with the Newton iterations it took, see tiles.isph. The
+// tile spans from the start of the task or the end of the previous tile until now
+extern "C" void trace_tile(int32_t x0, int32_t y0, int32_t x1, int32_t y1, int64_t iterations);
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cstring>
+#include "video.h"
+
+using namespace std;
+
+// GIF LZW codes are at most 12 bits, the table is reset once all of them are taken
+const int GIF_MAX_CODE = 4095;
+const int GIF_MIN_CODE_SIZE = 8;
+// The logical screen and image sizes are 16 bit fields
+const int GIF_MAX_SIDE = 65535;
+
+static uint32_t color_key(Rgba color) {
+  return (uint32_t)color.r << 16 | (uint32_t)color.g << 8 | color.b;
+}
+
+static void put_u16(FILE* file, int value) {
+  fputc(value & 0xff, file);
+  fputc((value >> 8) & 0xff, file);
+}
+
+// Single quoted for sh, a quote inside closes the quoting, adds an escaped quote and reopens it
+static string shell_quote(const string& text) {
+  string quoted = "'";
+  for (char c : text) {
+    if (c == '\'') {
+      quoted += "'\\''";
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "'";
+}
+
+bool video_open(VideoWriter& writer, const string& path, int width, int height, int fps) {
+  writer.width = width;
+  writer.height = height;
+  writer.fps = fps;
+  writer.frame_count = 0;
+  writer.histogram.clear();
+
+  if (path.ends_with(".y4m")) {
+    writer.format = VIDEO_Y4M;
+    writer.file = fopen(path.c_str(), "wb");
+  } else if (path.ends_with(".gif")) {
+    if (width > GIF_MAX_SIDE || height > GIF_MAX_SIDE) {
+      fprintf(stderr, "GIF frames can't be larger than %dx%d\n", GIF_MAX_SIDE, GIF_MAX_SIDE);
+      return false;
+    }
+    writer.format = VIDEO_GIF;
+    writer.file = fopen(path.c_str(), "wb");
+  } else {
+    writer.format = VIDEO_FFMPEG;
+    string command = "ffmpeg -loglevel error -y -f rawvideo -pix_fmt rgba -s " + to_string(width) + "x" + to_string(height) +
+      " -r " + to_string(fps) + " -i - -pix_fmt yuv420p " + shell_quote(path);
+    writer.file = popen(command.c_str(), "w");
+  }
+  if (!writer.file) {
+    return false;
+  }
+
+  if (writer.format == VIDEO_Y4M) {
+    fprintf(writer.file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+  } else if (writer.format == VIDEO_GIF) {
+    // No global color table, every frame brings its own
+    fwrite("GIF89a", 1, 6, writer.file);
+    put_u16(writer.file, width);
+    put_u16(writer.file, height);
+    fputc(0x00, writer.file);
+    fputc(0, writer.file);
+    fputc(0, writer.file);
+    // Loop forever
+    const uint8_t netscape[] = {0x21, 0xff, 0x0b, 'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 0x03, 0x01, 0x00, 0x00, 0x00};
+    fwrite(netscape, 1, sizeof(netscape), writer.file);
+  }
+  return !ferror(writer.file);
+}
+
+// BT.601 studio swing, planar 4:4:4 so no chroma is averaged away on the sharp basin borders
+static void write_y4m(VideoWriter& writer, const Rgba* pixels) {
+  size_t pixel_count = (size_t)writer.width * writer.height;
+  writer.buffer.resize(pixel_count * 3);
+  uint8_t* y_plane = writer.buffer.data();
+  uint8_t* u_plane = y_plane + pixel_count;
+  uint8_t* v_plane = u_plane + pixel_count;
+
+  for (size_t i = 0; i < pixel_count; i++) {
+    int r = pixels[i].r;
+    int g = pixels[i].g;
+    int b = pixels[i].b;
+    y_plane[i] = (uint8_t)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+    u_plane[i] = (uint8_t)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+    v_plane[i] = (uint8_t)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+  }
+  fwrite("FRAME\n", 1, 6, writer.file);
+  fwrite(writer.buffer.data(), 1, writer.buffer.size(), writer.file);
+}
+
+// Packs variable width codes LSB first into the 255 byte sub-blocks of GIF image data
+struct GifBits {
+  FILE* file;
+  uint32_t bits = 0;
+  int bit_count = 0;
+  uint8_t block[255];
+  int block_size = 0;
+
+  void byte(uint8_t value) {
+    block[block_size++] = value;
+    if (block_size == 255) {
+      flush_block();
+    }
+  }
+
+  void flush_block() {
+    if (block_size > 0) {
+      fputc(block_size, file);
+      fwrite(block, 1, block_size, file);
+      block_size = 0;
+    }
+  }
+
+  void code(int value, int code_size) {
+    bits |= (uint32_t)value << bit_count;
+    bit_count += code_size;
+    while (bit_count >= 8) {
+      byte(bits & 0xff);
+      bits >>= 8;
+      bit_count -= 8;
+    }
+  }
+
+  void finish() {
+    if (bit_count > 0) {
+      byte(bits & 0xff);
+    }
+    flush_block();
+    fputc(0, file);
+  }
+};
+
+// LZW over 8 bit indices. lzw_tree holds for every code the code of each one byte extension, 0 if
+// there is none yet
+static void write_gif_lzw(VideoWriter& writer, const uint8_t* indices, size_t count) {
+  const int clear_code = 1 << GIF_MIN_CODE_SIZE;
+  writer.lzw_tree.assign((size_t)(GIF_MAX_CODE + 1) * 256, 0);
+
+  fputc(GIF_MIN_CODE_SIZE, writer.file);
+  GifBits bits;
+  bits.file = writer.file;
+
+  int code_size = GIF_MIN_CODE_SIZE + 1;
+  int max_code = clear_code + 1;
+  bits.code(clear_code, code_size);
+
+  int current = indices[0];
+  for (size_t i = 1; i < count; i++) {
+    uint16_t& next = writer.lzw_tree[(size_t)current * 256 + indices[i]];
+    if (next) {
+      current = next;
+      continue;
+    }
+    bits.code(current, code_size);
+    next = ++max_code;
+    if (max_code >= (1 << code_size)) {
+      code_size++;
+    }
+    if (max_code == GIF_MAX_CODE) {
+      bits.code(clear_code, code_size);
+      fill(writer.lzw_tree.begin(), writer.lzw_tree.end(), 0);
+      code_size = GIF_MIN_CODE_SIZE + 1;
+      max_code = clear_code + 1;
+    }
+    current = indices[i];
+  }
+  bits.code(current, code_size);
+  bits.code(clear_code + 1, code_size);
+  bits.finish();
+}
+
+static void write_gif(VideoWriter& writer, const Rgba* pixels) {
+  size_t pixel_count = (size_t)writer.width * writer.height;
+
+  // Fractal frames are long runs of the same few hundred palette colors
+  unordered_map<uint32_t, uint64_t> frame_colors;
+  uint32_t run_key = color_key(pixels[0]);
+  uint64_t run_length = 0;
+  for (size_t i = 0; i < pixel_count; i++) {
+    uint32_t key = color_key(pixels[i]);
+    if (key != run_key) {
+      frame_colors[run_key] += run_length;
+      run_key = key;
+      run_length = 0;
+    }
+    run_length++;
+  }
+  frame_colors[run_key] += run_length;
+  for (auto& [key, count] : frame_colors) {
+    writer.histogram[key] += count;
+  }
+
+  // The 256 most common colors over all frames so far, which keeps the palette stable
+  // between frames instead of flickering
+  vector<pair<uint64_t, uint32_t>> ranked;
+  ranked.reserve(writer.histogram.size());
+  for (auto& [key, count] : writer.histogram) {
+    ranked.push_back({count, key});
+  }
+  int palette_size = min((int)ranked.size(), 256);
+  partial_sort(ranked.begin(), ranked.begin() + palette_size, ranked.end(), greater<>());
+
+  // Every color of this frame onto its nearest palette entry
+  unordered_map<uint32_t, uint8_t> nearest;
+  for (auto& [key, count] : frame_colors) {
+    int r = key >> 16;
+    int g = (key >> 8) & 0xff;
+    int b = key & 0xff;
+    int best = 0;
+    int best_distance = INT32_MAX;
+    for (int i = 0; i < palette_size && best_distance > 0; i++) {
+      uint32_t entry = ranked[i].second;
+      int dr = r - (int)(entry >> 16);
+      int dg = g - (int)((entry >> 8) & 0xff);
+      int db = b - (int)(entry & 0xff);
+      int distance = dr * dr + dg * dg + db * db;
+      if (distance < best_distance) {
+        best = i;
+        best_distance = distance;
+      }
+    }
+    nearest[key] = (uint8_t)best;
+  }
+
+  writer.buffer.resize(pixel_count);
+  uint32_t last_key = color_key(pixels[0]);
+  uint8_t last_index = nearest[last_key];
+  for (size_t i = 0; i < pixel_count; i++) {
+    uint32_t key = color_key(pixels[i]);
+    if (key != last_key) {
+      last_key = key;
+      last_index = nearest[key];
+    }
+    writer.buffer[i] = last_index;
+  }
+
+  // Graphic control extension with the frame delay in centiseconds
+  const uint8_t control[] = {0x21, 0xf9, 0x04, 0x04};
+  fwrite(control, 1, sizeof(control), writer.file);
+  put_u16(writer.file, max(1, 100 / writer.fps));
+  fputc(0, writer.file);
+  fputc(0, writer.file);
+
+  // Image descriptor with a local color table of 256 entries
+  fputc(0x2c, writer.file);
+  put_u16(writer.file, 0);
+  put_u16(writer.file, 0);
+  put_u16(writer.file, writer.width);
+  put_u16(writer.file, writer.height);
+  fputc(0x87, writer.file);
+  for (int i = 0; i < 256; i++) {
+    uint32_t entry = i < palette_size ? ranked[i].second : 0;
+    fputc(entry >> 16, writer.file);
+    fputc((entry >> 8) & 0xff, writer.file);
+    fputc(entry & 0xff, writer.file);
+  }
+
+  write_gif_lzw(writer, writer.buffer.data(), pixel_count);
+}
+
+bool video_write(VideoWriter& writer, const Rgba* pixels) {
+  if (writer.format == VIDEO_Y4M) {
+    write_y4m(writer, pixels);
+  } else if (writer.format == VIDEO_GIF) {
+    write_gif(writer, pixels);
+  } else {
+    fwrite(pixels, sizeof(Rgba), (size_t)writer.width * writer.height, writer.file);
+  }
+  writer.frame_count++;
+  return !ferror(writer.file);
+}
+
+bool video_close(VideoWriter& writer) {
+  if (!writer.file) {
+    return false;
+  }
+  bool ok;
+  if (writer.format == VIDEO_FFMPEG) {
+    ok = pclose(writer.file) == 0;
+  } else {
+    if (writer.format == VIDEO_GIF) {
+      fputc(0x3b, writer.file);
+    }
+    ok = !ferror(writer.file);
+    ok = fclose(writer.file) == 0 && ok;
+  }
+  writer.file = nullptr;
+  return ok;
+}
+
+bool write_ppm(const string& path, const Rgba* pixels, int width, int height) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (!file) {
+    return false;
+  }
+  fprintf(file, "P6\n%d %d\n255\n", width, height);
+
+  vector<unsigned char> row(width * 3);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const Rgba& color = pixels[y * width + x];
+      row[x * 3 + 0] = color.r;
+      row[x * 3 + 1] = color.g;
+      row[x * 3 + 2] = color.b;
+    }
+    fwrite(row.data(), 1, row.size(), file);
+  }
+  return fclose(file) == 0;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "color.h"
+
+enum VideoFormat {
+  // Uncompressed YUV 4:4:4, plays in ffmpeg/mpv and converts to anything without a second decode
+  VIDEO_Y4M,
+  // Animated GIF, the palette is rebuilt for every frame from the colors of all frames so far
+  VIDEO_GIF,
+  // Raw RGBA piped into a local ffmpeg process, which picks the codec from the file extension
+  VIDEO_FFMPEG
+};
+
+// Streams frames into a single file as they arrive, nothing is buffered beyond the current frame
+struct VideoWriter {
+  VideoFormat format = VIDEO_Y4M;
+  FILE* file = nullptr;
+  int width = 0;
+  int height = 0;
+  int fps = 0;
+  int frame_count = 0;
+
+  // Reused between frames
+  std::vector<uint8_t> buffer;
+
+  // GIF state, color counts over every frame written and the LZW code tree
+  std::unordered_map<uint32_t, uint64_t> histogram;
+  std::vector<uint16_t> lzw_tree;
+};
+
+// Picks the format from the extension of path, .y4m and .gif are written directly and
+// anything else goes through ffmpeg
+bool video_open(VideoWriter& writer, const std::string& path, int width, int height, int fps);
+bool video_write(VideoWriter& writer, const Rgba* pixels);
+// Finishes the file, for ffmpeg this waits for the encoder to exit
+bool video_close(VideoWriter& writer);
+
+// Single binary PPM image, the alpha channel is dropped
+bool write_ppm(const std::string& path, const Rgba* pixels, int width, int height);
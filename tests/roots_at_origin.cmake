@@ -0,0 +1,42 @@
+# Renders a 64x64 view centered on z = 0 with one kernel and checks that every pixel got a root
+# below n. Pixel (32, 32) sits exactly on z = 0, which the Newton iteration turns into NaN.
+# Run by ctest with -DHEADLESS=<binary> -DMODE=<mode> -DPRECISION=<precision> -DOUTPUT=<path>
+set(size 64)
+set(n 3)
+
+if (MODE STREQUAL "fused")
+  # No root plane to look at, the palette lookups must not crash
+  set(output ${OUTPUT}.ppm)
+else()
+  set(output ${OUTPUT}.raw)
+endif()
+
+execute_process(
+  COMMAND ${HEADLESS} --size ${size}x${size} --n ${n} --mode ${MODE} --precision ${PRECISION} --tasks 4 --output ${output}
+  RESULT_VARIABLE result
+  OUTPUT_QUIET
+)
+if (NOT result EQUAL 0)
+  message(FATAL_ERROR "${HEADLESS} failed with ${result}")
+endif()
+if (MODE STREQUAL "fused")
+  return()
+endif()
+
+# The raw file holds the uint16 depth plane followed by the uint8 root plane
+math(EXPR pixels "${size} * ${size}")
+math(EXPR roots_offset "${pixels} * 2")
+file(READ ${output} roots OFFSET ${roots_offset} LIMIT ${pixels} HEX)
+string(LENGTH "${roots}" hex_length)
+math(EXPR expected_length "${pixels} * 2")
+if (NOT hex_length EQUAL expected_length)
+  message(FATAL_ERROR "${output} is too short")
+endif()
+string(REGEX MATCHALL ".." bytes "${roots}")
+list(REMOVE_DUPLICATES bytes)
+foreach(byte ${bytes})
+  math(EXPR root "0x${byte}")
+  if (root GREATER_EQUAL n)
+    message(FATAL_ERROR "${MODE} ${PRECISION} wrote root ${root}, n is ${n}")
+  endif()
+endforeach()